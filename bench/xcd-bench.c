@@ -0,0 +1,790 @@
+// xcd-bench.c - micro-benchmarks for xcd-core internals
+// Compile with:  gcc -std=c11 -Wall -O2 -pthread -o xcd-bench bench/xcd-bench.c
+//
+// Usage:  xcd-bench dedup       Hash-set dedup vs. the old linear scan
+//         xcd-bench match       Basename substring kernels vs. strstr()
+//         xcd-bench serve [XCD-CORE]
+//                               One-shot xcd-core vs. --client to --serve
+//         xcd-bench batch [XCD-CORE]
+//                               A loop of xcd-core -l vs. one --batch
+//         xcd-bench phases [MAX-ENTRIES]
+//                               p50/p99 of load, match, picker, preview and save
+//                               on synthetic memory files, 1k .. 1M entries
+
+#define XCD_NO_MAIN
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "../xcd-core.c"
+
+#include <time.h>
+#include <sys/wait.h>
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// p-th percentile of n samples; sorts them.
+static double percentile(double *v, int n, double p)
+{
+    qsort(v, (size_t)n, sizeof(v[0]), cmp_double);
+    int i = (int)(p / 100.0 * (n - 1) + 0.5);
+    return v[i];
+}
+
+/* Synthetic paths shaped like a monorepo checkout: a long shared prefix,
+   a few levels of fan-out, and about one line in ten repeating an earlier
+   one (as a memory file that has been appended to by several shells). */
+static char **make_paths(int n)
+{
+    char **paths = malloc((size_t)n * sizeof(paths[0]));
+    if (!paths)
+    {
+        fprintf(stderr, "xcd-bench: out of memory\n");
+        exit(1);
+    }
+
+    char buf[PATH_MAX];
+    for (int i = 0; i < n; i++)
+    {
+        int k = (i % 10 == 9) ? i / 2 : i;
+        snprintf(buf, sizeof(buf),
+                 "/home/user/work/monorepo/pkg%03d/src/module%d/part%d",
+                 k % 997, k / 997, k);
+        paths[i] = strdup(buf);
+        if (!paths[i])
+        {
+            fprintf(stderr, "xcd-bench: out of memory\n");
+            exit(1);
+        }
+    }
+    return paths;
+}
+
+// The pre-hash-set contains_dir(): a strcmp over every kept entry.
+static int linear_contains(char **kept, int nkept, const char *path)
+{
+    for (int i = 0; i < nkept; i++)
+        if (strcmp(kept[i], path) == 0)
+            return 1;
+    return 0;
+}
+
+static void bench_dedup()
+{
+    static const int sizes[] = { 8192, 100000, 1000000 };
+    const int linear_max = 20000; // beyond this, extrapolate O(n^2)
+
+    printf("%10s %12s %16s %10s\n", "entries", "hash ms", "linear ms", "unique");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        int n = sizes[s];
+        char **paths = make_paths(n);
+
+        double t0 = now_ms();
+        for (int i = 0; i < n; i++)
+            if (find_dir(paths[i]) < 0)
+                append_dir(paths[i]);
+        double hash_ms = now_ms() - t0;
+        int unique = dir_count;
+
+        // Detach the borrowed pointers before resetting the store.
+        dir_count = 0;
+        free_memory_list();
+
+        int m = n < linear_max ? n : linear_max;
+        char **kept = malloc((size_t)m * sizeof(kept[0]));
+        int nkept = 0;
+        t0 = now_ms();
+        for (int i = 0; i < m; i++)
+            if (!linear_contains(kept, nkept, paths[i]))
+                kept[nkept++] = paths[i];
+        double linear_ms = now_ms() - t0;
+        free(kept);
+
+        if (m < n)
+        {
+            double scale = (double)n / m;
+            printf("%10d %12.2f %10.0f (est.) %10d\n",
+                   n, hash_ms, linear_ms * scale * scale, unique);
+        }
+        else
+        {
+            printf("%10d %12.2f %16.2f %10d\n", n, hash_ms, linear_ms, unique);
+        }
+
+        for (int i = 0; i < n; i++)
+            free(paths[i]);
+        free(paths);
+    }
+}
+
+static void bench_match()
+{
+    static const int sizes[] = { 10000, 100000, 1000000 };
+    static const char *segments[] = { "rt9", "part4242", "nomatch" };
+
+    struct { const char *name; find_kernel_fn fn; } kernels[3];
+    int nkernels = 0;
+    kernels[nkernels].name = "scalar";
+    kernels[nkernels++].fn = find_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    kernels[nkernels].name = "sse2";
+    kernels[nkernels++].fn = find_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernels[nkernels].name = "avx2";
+        kernels[nkernels++].fn = find_avx2;
+    }
+#endif
+
+    printf("%10s %-10s %8s %12s", "entries", "segment", "matches", "strstr ms");
+    for (int k = 0; k < nkernels; k++)
+        printf(" %10s ms", kernels[k].name);
+    printf("\n");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        int n = sizes[s];
+        int reps = 2000000 / n;
+        char **paths = make_paths(n);
+
+        for (int i = 0; i < n; i++)
+            append_dir(paths[i]);
+
+        for (size_t g = 0; g < sizeof(segments) / sizeof(segments[0]); g++)
+        {
+            const char *seg = segments[g];
+            int expect = 0;
+
+            // the per-entry loop the kernels replace
+            double t0 = now_ms();
+            for (int r = 0; r < reps; r++)
+            {
+                expect = 0;
+                for (int i = 0; i < dir_count; i++)
+                    if (strstr(base_name(dirs[i]), seg))
+                        expect++;
+            }
+            printf("%10d %-10s %8d %12.3f", n, seg, expect, (now_ms() - t0) / reps);
+
+            for (int k = 0; k < nkernels; k++)
+            {
+                find_kernel = kernels[k].fn;
+                int count = 0;
+                t0 = now_ms();
+                for (int r = 0; r < reps; r++)
+                {
+                    int cap = 64;
+                    int *indices = xrealloc(NULL, (size_t)cap * sizeof(indices[0]));
+                    count = 0;
+                    scan_matches(seg, 0, &indices, &count, &cap);
+                    free(indices);
+                }
+                double ms = (now_ms() - t0) / reps;
+                if (count != expect)
+                    printf(" %10s   ", "MISMATCH");
+                else
+                    printf(" %13.3f", ms);
+            }
+            printf("\n");
+        }
+
+        dir_count = 0;
+        free_memory_list();
+        for (int i = 0; i < n; i++)
+            free(paths[i]);
+        free(paths);
+    }
+}
+
+/* Latency of a navigation as the shell wrapper sees it: fork/exec of
+   xcd-core loading and saving the memory itself, against xcd-core
+   --client handing the same request to a running --serve. */
+
+static double run_core(const char *core, char *const argv[])
+{
+    double t0 = now_ms();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execv(core, argv);
+        _exit(127);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "xcd-bench: %s failed\n", core);
+        exit(1);
+    }
+    return now_ms() - t0;
+}
+
+static void bench_serve(const char *core)
+{
+    static const int sizes[] = { 1000, 10000, 100000 };
+    const int reps = 100;
+
+    char home[] = "/tmp/xcd-bench-XXXXXX";
+    char target[PATH_MAX], memory[PATH_MAX], sock[PATH_MAX];
+    if (!mkdtemp(home) || !realpath(core, target))
+    {
+        fprintf(stderr, "xcd-bench: cannot set up %s for %s\n", home, core);
+        exit(1);
+    }
+    core = strdup(target);
+    snprintf(target, sizeof(target), "%s/xcdbenchtarget", home);
+    snprintf(memory, sizeof(memory), "%s/.xcd_memory", home);
+    snprintf(sock, sizeof(sock), "%s/xcd-core.sock", home);
+    mkdir(target, 0755);
+    setenv("HOME", home, 1);
+    setenv("XDG_RUNTIME_DIR", home, 1);
+    if (chdir(home) != 0)
+        exit(1);
+
+    char *oneshot[] = { (char *)core, "xcdbenchtarget", NULL };
+    char *client[] = { (char *)core, "--client", "xcdbenchtarget", NULL };
+    char *serve[] = { (char *)core, "--serve", NULL };
+    double *ms = malloc(reps * sizeof(ms[0]));
+
+    printf("%10s %14s %14s %14s %14s\n", "entries",
+           "one-shot p50", "one-shot p99", "client p50", "client p99");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        int n = sizes[s];
+        char **paths = make_paths(n);
+        FILE *f = fopen(memory, "w");
+        for (int i = 0; i < n; i++)
+            fprintf(f, "%s\n", paths[i]);
+        fprintf(f, "%s\n", target);
+        fclose(f);
+
+        for (int r = 0; r < reps; r++)
+            ms[r] = run_core(core, oneshot);
+        double p50 = percentile(ms, reps, 50);
+        double p99 = percentile(ms, reps, 99);
+
+        pid_t server = fork();
+        if (server == 0)
+        {
+            execv(core, serve);
+            _exit(127);
+        }
+        struct stat st;
+        for (int t = 0; t < 500 && stat(sock, &st) != 0; t++)
+            usleep(10000);
+
+        for (int r = 0; r < reps; r++)
+            ms[r] = run_core(core, client);
+        printf("%10d %14.3f %14.3f %14.3f %14.3f\n", n, p50, p99,
+               percentile(ms, reps, 50), percentile(ms, reps, 99));
+
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+
+        unlink(memory);
+        for (int i = 0; i < n; i++)
+            free(paths[i]);
+        free(paths);
+    }
+
+    free(ms);
+    rmdir(target);
+    rmdir(home);
+}
+
+/* Resolving many segments: a loop of xcd-core -l SEG, one process per
+   query, against a single xcd-core --batch fed every query on stdin.
+   Each query names one of BATCH_REAL real directories, so listing it
+   stats a live entry and drops nothing. */
+
+#define BATCH_REAL 256
+
+static double run_batch(const char *core, const char *input, size_t len)
+{
+    int in[2];
+    if (pipe(in) != 0)
+        exit(1);
+
+    double t0 = now_ms();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(in[0], STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        execl(core, core, "--batch", (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+
+    for (size_t sent = 0; sent < len; )
+    {
+        ssize_t n = write(in[1], input + sent, len - sent);
+        if (n <= 0)
+            break;
+        sent += (size_t)n;
+    }
+    close(in[1]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "xcd-bench: %s --batch failed\n", core);
+        exit(1);
+    }
+    return now_ms() - t0;
+}
+
+static void bench_batch(const char *core)
+{
+    static const int sizes[] = { 1000, 10000, 100000 };
+
+    char home[] = "/tmp/xcd-bench-XXXXXX";
+    char real[PATH_MAX], memory[PATH_MAX];
+    if (!mkdtemp(home) || !realpath(core, real))
+    {
+        fprintf(stderr, "xcd-bench: cannot set up %s for %s\n", home, core);
+        exit(1);
+    }
+    core = strdup(real);
+    snprintf(memory, sizeof(memory), "%s/.xcd_memory", home);
+    setenv("HOME", home, 1);
+    if (chdir(home) != 0)
+        exit(1);
+
+    char *input = malloc(BATCH_REAL * 32);
+    size_t len = 0;
+    for (int r = 0; r < BATCH_REAL; r++)
+    {
+        snprintf(real, sizeof(real), "%s/xcdbatch-%03d", home, r);
+        mkdir(real, 0755);
+        len += (size_t)sprintf(input + len, "xcdbatch-%03d\n", r);
+    }
+
+    printf("%10s %8s %14s %14s %14s %14s\n", "entries", "queries",
+           "loop ms", "batch ms", "loop us/q", "batch us/q");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        int n = sizes[s];
+        char **paths = make_paths(n);
+        FILE *f = fopen(memory, "w");
+        for (int i = 0; i < n; i++)
+            fprintf(f, "%s\n", paths[i]);
+        for (int r = 0; r < BATCH_REAL; r++)
+            fprintf(f, "%s/xcdbatch-%03d\n", home, r);
+        fclose(f);
+
+        double loop = 0;
+        for (int r = 0; r < BATCH_REAL; r++)
+        {
+            char seg[32];
+            snprintf(seg, sizeof(seg), "xcdbatch-%03d", r);
+            char *argv[] = { (char *)core, "-l", seg, NULL };
+            loop += run_core(core, argv);
+        }
+        double batch = run_batch(core, input, len);
+
+        printf("%10d %8d %14.3f %14.3f %14.1f %14.1f\n", n, BATCH_REAL,
+               loop, batch, loop * 1000 / BATCH_REAL, batch * 1000 / BATCH_REAL);
+
+        unlink(memory);
+        for (int i = 0; i < n; i++)
+            free(paths[i]);
+        free(paths);
+    }
+
+    if (chdir("/") != 0)
+        exit(1);
+    for (int r = 0; r < BATCH_REAL; r++)
+    {
+        snprintf(real, sizeof(real), "%s/xcdbatch-%03d", home, r);
+        rmdir(real);
+    }
+    rmdir(home);
+    free(input);
+}
+
+/* ---------- Phases ---------- */
+
+/* The hot path, phase by phase, on a synthetic ~/.xcd_memory in a temp
+   HOME.  Paths are 3 to 8 levels deep under a few hundred projects, with
+   basenames drawn Zipf-like from the names real trees repeat (src, lib,
+   test, ...) plus a long tail of one-off names.  64 of the entries are
+   real directories named xcdbench-NN, which is what preview cycles over,
+   since it stats the rows it prints. */
+
+#define PHASE_REAL 64
+
+static uint64_t rng_state = 88172645463325252ull;
+
+static uint32_t rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 32);
+}
+
+// Most frequent first.
+static const char *common_names[] =
+{
+    "src", "lib", "test", "main", "include", "docs", "build", "utils",
+    "core", "api", "internal", "config", "scripts", "cmd", "pkg", "web",
+    "app", "components", "models", "assets", "tests", "java", "resources",
+    "tools", "examples",
+};
+
+static const char *common_name()
+{
+    int n = (int)(sizeof(common_names) / sizeof(common_names[0]));
+    double u = rng() / 4294967296.0;
+    return common_names[(int)(n * u * u * u)];
+}
+
+static void synthetic_path(char *buf, size_t size, int i)
+{
+    int depth = 3 + (int)(rng() % 6);
+    int len = snprintf(buf, size, "/home/user/work/proj%d", i / 400);
+    for (int d = 1; d < depth && len < (int)size; d++)
+    {
+        if (rng() % 4 == 0)
+            len += snprintf(buf + len, size - (size_t)len, "/mod%u", rng() % 1000);
+        else
+            len += snprintf(buf + len, size - (size_t)len, "/%s", common_name());
+    }
+    if (rng() % 10 < 6)
+        snprintf(buf + len, size - (size_t)len, "/%s", common_name());
+    else
+        snprintf(buf + len, size - (size_t)len, "/feature_%d", i);
+}
+
+// Forget everything load_memory() set up, so it can run again.
+static void unload_memory()
+{
+    free_memory_list();
+    if (index_map)
+        munmap(index_map, index_map_len);
+    index_map = NULL;
+    index_map_len = 0;
+    index_trigrams = NULL;
+    index_postings = NULL;
+    index_tri_count = 0;
+    index_post_count = 0;
+    index_slot_count = 0;
+    memory_dirty = 0;
+    index_dirty = 0;
+    compact_needed = 0;
+    saved_count = 0;
+    journal_records = 0;
+    memory_loaded_size = 0;
+    memory_dev = 0;
+    memory_ino = 0;
+}
+
+static void report(int n, const char *phase, double *ms, int reps)
+{
+    double p50 = percentile(ms, reps, 50);
+    double p99 = percentile(ms, reps, 99);
+    printf("%10d %-28s %6d %12.3f %12.3f\n", n, phase, reps, p50, p99);
+    fflush(stdout);
+}
+
+static void bench_phases(int max_entries)
+{
+    static const int sizes[] = { 1000, 10000, 100000, 1000000 };
+    static const char *queries[] = { "src", "feature_42", "xcdbench",
+                                     "proj1 core src", "proj42 src", "compnents" };
+
+    char home[] = "/tmp/xcd-bench-XXXXXX";
+    if (!mkdtemp(home))
+    {
+        fprintf(stderr, "xcd-bench: cannot create %s\n", home);
+        exit(1);
+    }
+    setenv("HOME", home, 1);
+
+    char real[PHASE_REAL][PATH_MAX];
+    for (int r = 0; r < PHASE_REAL; r++)
+    {
+        snprintf(real[r], sizeof(real[r]), "%s/xcdbench-%02d", home, r);
+        mkdir(real[r], 0755);
+    }
+
+    // stdout of the commands being timed goes to /dev/null
+    int null = open("/dev/null", O_WRONLY);
+    int out = dup(STDOUT_FILENO);
+
+    printf("%10s %-28s %6s %12s %12s\n", "entries", "phase", "reps", "p50 ms", "p99 ms");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        int n = sizes[s];
+        if (n > max_entries)
+            break;
+
+        int reps = 2000000 / n;
+        if (reps > 200)
+            reps = 200;
+        if (reps < 20)
+            reps = 20;
+        double *ms = malloc((size_t)reps * sizeof(ms[0]));
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/.xcd_memory", home);
+        FILE *f = fopen(path, "w");
+        int stride = n / PHASE_REAL;
+        for (int i = 0; i < n; i++)
+        {
+            if (i % stride == 0 && i / stride < PHASE_REAL)
+            {
+                fprintf(f, "%s\n", real[i / stride]);
+                continue;
+            }
+            synthetic_path(path, sizeof(path), i);
+            fprintf(f, "%s\n", path);
+        }
+        fclose(f);
+
+        for (int idx = 0; idx < 2; idx++)
+        {
+            const char *tag = idx ? " (index)" : "";
+            char phase[64];
+
+            if (idx)
+            {
+                // build the index, then time everything against it
+                unload_memory();
+                load_memory();
+                cmd_index();
+            }
+
+            for (int r = 0; r < reps; r++)
+            {
+                unload_memory();
+                double t0 = now_ms();
+                load_memory();
+                ms[r] = now_ms() - t0;
+            }
+            snprintf(phase, sizeof(phase), "load%s", tag);
+            report(n, phase, ms, reps);
+
+            for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); q++)
+            {
+                // multi-segment queries are space separated
+                char text[64];
+                char *segs[8];
+                int nseg = 0;
+                snprintf(text, sizeof(text), "%s", queries[q]);
+                for (char *t = strtok(text, " "); t && nseg < 8; t = strtok(NULL, " "))
+                    segs[nseg++] = t;
+
+                int count = 0;
+                for (int r = 0; r < reps; r++)
+                {
+                    int *indices;
+                    double t0 = now_ms();
+                    count = find_query(nseg, segs, &indices);
+                    ms[r] = now_ms() - t0;
+                    free(indices);
+                }
+                snprintf(phase, sizeof(phase), "match %s%s", queries[q], tag);
+                report(n, phase, ms, reps);
+                (void)count;
+            }
+
+            // a segment scoped to one project's 400 entries, as by xcd -w
+            query_scope = "/home/user/work/proj1";
+            for (int r = 0; r < reps; r++)
+            {
+                int *indices;
+                char *segment = "src";
+                double t0 = now_ms();
+                find_query(1, &segment, &indices);
+                ms[r] = now_ms() - t0;
+                free(indices);
+            }
+            query_scope = NULL;
+            snprintf(phase, sizeof(phase), "match -w src%s", tag);
+            report(n, phase, ms, reps);
+
+            // a glob, then a regular expression, over every basename
+            static char *patterns[] = { "feature_4*2", "^lib[0-9]+$" };
+            for (int k = 0; k < 2; k++)
+            {
+                query_regex = k;
+                for (int r = 0; r < reps; r++)
+                {
+                    int *indices;
+                    double t0 = now_ms();
+                    find_query(1, &patterns[k], &indices);
+                    ms[r] = now_ms() - t0;
+                    free(indices);
+                }
+                query_regex = 0;
+                snprintf(phase, sizeof(phase), "match %s%s%s",
+                         k ? "-r " : "", patterns[k], tag);
+                report(n, phase, ms, reps);
+            }
+
+            // xcd -i: opening on every entry, then typing "feature_42" a
+            // key at a time and erasing it; rows are ranked, not stat()ed
+            static const char typed[] = "feature_42";
+            const int keys = 2 * (int)(sizeof(typed) - 1);
+            double *key_ms = malloc((size_t)(reps * keys) * sizeof(key_ms[0]));
+            struct picker *pk = malloc(sizeof(*pk));
+            for (int r = 0; r < reps; r++)
+            {
+                double t0 = now_ms();
+                picker_init(pk);
+                select_top(pk->levels[0].indices, pk->levels[0].count, 20, pk->now);
+                ms[r] = now_ms() - t0;
+
+                for (int k = 0; k < keys; k++)
+                {
+                    char text[sizeof(typed)];
+                    int len = (k < keys / 2) ? k + 1 : keys - k - 1;
+                    snprintf(text, sizeof(text), "%.*s", len, typed);
+
+                    t0 = now_ms();
+                    picker_query(pk, text);
+                    struct pick_level *top = &pk->levels[pk->depth - 1];
+                    select_top(top->indices, top->count, 20, pk->now);
+                    key_ms[r * keys + k] = now_ms() - t0;
+                }
+                picker_free(pk);
+            }
+            snprintf(phase, sizeof(phase), "pick open%s", tag);
+            report(n, phase, ms, reps);
+            snprintf(phase, sizeof(phase), "pick keystroke%s", tag);
+            report(n, phase, key_ms, reps * keys);
+            free(pk);
+            free(key_ms);
+
+            // -p while cycling through the real matches
+            fflush(stdout);
+            dup2(null, STDOUT_FILENO);
+            for (int r = 0; r < reps; r++)
+            {
+                if (chdir(real[r % PHASE_REAL]) != 0)
+                    exit(1);
+                double t0 = now_ms();
+                char *segment = "xcdbench";
+                cmd_preview(1, &segment);
+                fflush(stdout);
+                ms[r] = now_ms() - t0;
+            }
+            dup2(out, STDOUT_FILENO);
+            snprintf(phase, sizeof(phase), "preview cycle%s", tag);
+            report(n, phase, ms, reps);
+
+            // a navigation's save: one visit appended
+            for (int r = 0; r < reps; r++)
+            {
+                record_visit(find_dir(real[r % PHASE_REAL]));
+                double t0 = now_ms();
+                save_memory();
+                ms[r] = now_ms() - t0;
+            }
+            snprintf(phase, sizeof(phase), "save append%s", tag);
+            report(n, phase, ms, reps);
+
+            // the occasional full rewrite
+            for (int r = 0; r < reps; r++)
+            {
+                memory_dirty = 1;
+                compact_needed = 1;
+                double t0 = now_ms();
+                save_memory();
+                ms[r] = now_ms() - t0;
+            }
+            snprintf(phase, sizeof(phase), "save compact%s", tag);
+            report(n, phase, ms, reps);
+
+            // the index rebuild a compaction leaves to a detached child
+            if (idx)
+            {
+                for (int r = 0; r < reps; r++)
+                {
+                    double t0 = now_ms();
+                    save_index();
+                    ms[r] = now_ms() - t0;
+                }
+                snprintf(phase, sizeof(phase), "index rebuild%s", tag);
+                report(n, phase, ms, reps);
+            }
+        }
+
+        unload_memory();
+        snprintf(path, sizeof(path), "%s/.xcd_memory", home);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/.xcd_memory.idx", home);
+        unlink(path);
+        free(ms);
+    }
+
+    if (chdir("/") != 0)
+        exit(1);
+    for (int r = 0; r < PHASE_REAL; r++)
+        rmdir(real[r]);
+    rmdir(home);
+    close(null);
+    close(out);
+}
+
+int main(int argc, char **argv)
+{
+    const char *which = (argc >= 2) ? argv[1] : "dedup";
+
+    if (strcmp(which, "dedup") == 0)
+    {
+        bench_dedup();
+        return 0;
+    }
+
+    if (strcmp(which, "match") == 0)
+    {
+        bench_match();
+        return 0;
+    }
+
+    if (strcmp(which, "serve") == 0)
+    {
+        bench_serve((argc >= 3) ? argv[2] : "./xcd-core");
+        return 0;
+    }
+
+    if (strcmp(which, "batch") == 0)
+    {
+        bench_batch((argc >= 3) ? argv[2] : "./xcd-core");
+        return 0;
+    }
+
+    if (strcmp(which, "phases") == 0)
+    {
+        bench_phases((argc >= 3) ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+
+    fprintf(stderr, "usage: xcd-bench dedup|match|serve [XCD-CORE]|batch [XCD-CORE]|phases [MAX-ENTRIES]\n");
+    return 1;
+}
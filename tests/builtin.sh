@@ -0,0 +1,50 @@
+#!/bin/sh
+# tests/builtin.sh - build xcd.so and run it as a builtin in a real bash
+#
+# Usage:  tests/builtin.sh
+# Set BASH_CFLAGS to point at bash's headers when they are not under
+# /usr/include/bash (the bash-builtins / bash-devel package).
+
+set -u
+
+cd "$(dirname "$0")/.." || exit 1
+
+: "${CC:=cc}"
+: "${BASH_CFLAGS:=-I/usr/include/bash -I/usr/include/bash/include -I/usr/include/bash/builtins}"
+
+work=$(mktemp -d /tmp/xcd-test-XXXXXX) || exit 1
+trap 'rm -rf "$work"' EXIT
+
+# shellcheck disable=SC2086
+$CC -std=c11 -O2 -pthread -fPIC -shared -DXCD_BUILTIN $BASH_CFLAGS \
+    -o "$work/xcd.so" xcd-core.c || exit 1
+
+home=$(cd "$work" && pwd -P)
+mkdir -p "$home/w/foo"
+
+failed=0
+
+# name, expected output, script
+check()
+{
+    got=$(env -i HOME="$home" PATH=/usr/bin:/bin bash --norc --noprofile \
+          -c "enable -f '$work/xcd.so' xcd; cd /; $3" 2>&1)
+    if [ "$got" = "$2" ]
+    then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        echo "  expected: $2"
+        echo "  got:      $got"
+        failed=1
+    fi
+}
+
+check "bare xcd goes home" "0 $home" 'xcd; echo "$? $PWD"'
+check "xcd DIR" "0 $home/w/foo" "xcd '$home/w/foo'; echo \"\$? \$PWD\""
+check "xcd SEGMENT" "0 $home/w/foo" 'xcd foo; echo "$? $PWD"'
+check "no match" "xcd-core: no directory matches \"nosuch\"
+1 /" 'xcd nosuch; echo "$? $PWD"'
+check "xcd -l" "$home/w/foo" 'xcd -l foo'
+
+exit $failed
@@ -0,0 +1,66 @@
+#!/bin/sh
+# tests/patterns.sh - xcd-core -l with glob and regex segments
+#
+# Usage:  tests/patterns.sh
+# Each case runs without and then with the binary index, whose trigram
+# postings prefilter the entries by the literal a pattern requires.
+
+set -u
+
+cd "$(dirname "$0")/.." || exit 1
+
+: "${CC:=cc}"
+
+work=$(mktemp -d /tmp/xcd-test-XXXXXX) || exit 1
+trap 'rm -rf "$work"' EXIT
+
+$CC -std=c11 -O2 -pthread -o "$work/xcd-core" xcd-core.c || exit 1
+
+home=$(cd "$work" && pwd -P)
+for name in abcd ']bcd' xbcd '-bcd' lib7 lib77 feature_42
+do
+    mkdir -p "$home/t/$name"
+    echo "$home/t/$name"
+done > "$home/.xcd_memory"
+
+failed=0
+
+# expected basenames (space separated, in memory order), then the arguments
+check()
+{
+    expected=$1
+    shift
+    got=$(cd / && HOME="$home" "$work/xcd-core" -l "$@" |
+          sed 's|.*/||' | tr '\n' ' ' | sed 's/ $//')
+    if [ "$got" = "$expected" ]
+    then
+        echo "ok   $label: $*"
+    else
+        echo "FAIL $label: $*"
+        echo "  expected: $expected"
+        echo "  got:      $got"
+        failed=1
+    fi
+}
+
+run_cases()
+{
+    # an escaped ] inside a class is a member, not the end of it
+    check "abcd ]bcd" -r '[a\]]bcd'
+    check "abcd ]bcd" -r '^[a\]]bcd$'
+    check "]bcd xbcd" -r '[]x]bcd'
+    check "abcd ]bcd -bcd" -r '[^x]bcd'
+    check "-bcd lib7 lib77 feature_42" -r '[\d-]'
+    check "abcd" -r '([)]q)?abcd'
+    check "lib7" -r '^lib\d$'
+    check "abcd ]bcd -bcd" '[!x]bcd'
+    check "feature_42" 'feat*_4?'
+}
+
+label="text"
+run_cases
+HOME="$home" "$work/xcd-core" -x >/dev/null || exit 1
+label="index"
+run_cases
+
+exit $failed
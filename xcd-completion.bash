@@ -0,0 +1,30 @@
+# Tab completion for xcd in bash; source it from ~/.bashrc after xcd.sh.
+
+_xcd()
+{
+    local cur="${COMP_WORDS[COMP_CWORD]}"
+    COMPREPLY=()
+
+    # Options take no completion; paths complete as directories.
+    case "$cur" in
+        -*)
+            return 0
+            ;;
+        */*|.*|~*)
+            compopt -o filenames 2>/dev/null
+            mapfile -t COMPREPLY < <(compgen -d -- "$cur")
+            return 0
+            ;;
+    esac
+
+    local sock="${XDG_RUNTIME_DIR:-/tmp}/xcd-core.sock"
+    [ -n "$XDG_RUNTIME_DIR" ] || sock="/tmp/xcd-core-$UID.sock"
+    local client=
+    [ -S "$sock" ] && client=--client
+
+    # Remembered basenames, best first, then directories here.
+    mapfile -t COMPREPLY < <(xcd-core $client --complete "$cur" 2>/dev/null
+                             compgen -d -- "$cur")
+}
+
+complete -F _xcd xcd
@@ -1,5 +1,5 @@
 // xcd-core.c - cross-platform (Linux/macOS) core for xcd
-// Compile with:  gcc -std=c11 -Wall -O2 -o xcd-core xcd-core.c
+// Compile with:  gcc -std=c11 -Wall -O2 -pthread -o xcd-core xcd-core.c
 
 #define _GNU_SOURCE
 #define _POSIX_C_SOURCE 200809L
@@ -11,22 +11,528 @@
 #include <limits.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <pwd.h>
 #include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fnmatch.h>
+
+#ifdef XCD_BUILTIN
+#include <setjmp.h>
+#include "loadables.h"
+// bash has an xrealloc() of its own (sometimes a macro); keep ours apart
+#undef xrealloc
+#define xrealloc xcd_xrealloc
+// the one-shot, batch and server entry points are not used in the builtin
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
-#define MAX_DIRS 8192
+/* The remembered paths, stored as columns indexed by entry number.
+   entry_path() gives an entry's full path: entries from the binary index
+   are read straight from its string pool, the rest from dirs[], which
+   points into the path arena, never at individual allocations.
+   The basename column packs every basename, NUL-terminated, into one
+   buffer with an offset table (entry e spans base_start[e] ..
+   base_start[e + 1] - 1), so matching is a linear sweep over that buffer
+   and full paths are only touched for the rows that match.  Entries from
+   the binary index use the column stored in it (index_bases); the rest,
+   dirs[index_count ..], use base_buf, which append_dir() extends. */
 
-static char *dirs[MAX_DIRS];
+static char **dirs = NULL;
 static int dir_count = 0;
+static int dir_cap = 0;
+
+#define BASE_PAD 64  // zero bytes after a column so vector loads never overrun
+
+static char *base_buf = NULL;        // basenames of dirs[index_count ..]
+static size_t base_len = 0;
+static size_t base_buf_cap = 0;
+static uint32_t *base_start = NULL;  // base_count + 1 offsets into base_buf
+static int base_start_cap = 0;
+static int base_count = 0;
+
+/* Identity: the device and inode of each entry's directory, recorded
+   whenever it is stat()ed anyway.  The directory xcd runs in is then found
+   with a stat(".") and a hash lookup instead of a realpath(), which lstats
+   every component of a deep path, and a bind mount or other alias of a
+   remembered directory resolves to the same entry instead of a new one.
+   Entries from the binary index keep theirs in the index itself. */
+
+struct dir_inode
+{
+    uint64_t dev;
+    uint64_t ino;    // 0 until the directory has been stat()ed
+};
+
+static struct dir_inode *dir_inodes = NULL;  // used for dirs[index_count ..]
+
+/* Frecency: how often and how recently each entry was visited, parallel
+   to the paths.  A visit is counted when xcd leaves a directory, except when
+   it only steps to the next match of the same segment, so cycling past a
+   directory does not promote it but the one you settle in is. */
+
+static uint32_t *dir_visits = NULL;
+static uint32_t *dir_last = NULL;    // time of the last visit, Unix seconds
+static uint32_t *dir_peer_visits = NULL; // the same from other hosts' shards
+static uint32_t *dir_peer_last = NULL;
+static unsigned char *dir_peer = NULL;   // 1: only in other hosts' shards
+
+/* Loaded from the index, these columns are not copied: each is an
+   anonymous reservation with room to grow, over whose start the index's
+   column is mapped copy-on-write.  Entries are updated in place without
+   touching the file, and appended ones follow in the same array; a column
+   that outgrows its reservation moves to the heap. */
+
+struct column_map
+{
+    void *base;  // the reservation, NULL for a heap column
+    size_t size;
+};
+
+static struct column_map visits_map, last_map, peer_visits_map, peer_last_map,
+                         peer_map;
+
+struct visit
+{
+    int idx;
+    uint32_t when;
+};
+
+static struct visit *visit_log = NULL; // visits not yet written out
+static int visit_log_count = 0;
+static int visit_log_cap = 0;
 static int memory_dirty = 0;
 static char memory_file[PATH_MAX];
+static char index_file[PATH_MAX];
+
+/* Journal state (see "Load / Save memory") */
+
+#define COMPACT_SLACK 64     // redundant records tolerated before compacting
+
+static dev_t memory_dev;             // identity of the text file we loaded
+static ino_t memory_ino;
+static off_t memory_loaded_size = 0; // bytes of it consumed by load_memory()
+static int saved_count = 0;          // entries [0 .. saved_count) are on disk
+static int journal_records = 0;      // records in the file, duplicates included
+static int own_count = 0;            // live entries this host journals
+static int compact_needed = 0;
+
+/* Sharded memory, turned on by creating ~/.xcd_memory.d/.  Each host then
+   journals to a shard of its own, ~/.xcd_memory.d/<hostname>, which is
+   what everything above applies to, and only ever reads the others, its
+   peers.  So hosts sharing an NFS home never write to the same file.
+   Visits journaled by peers are counted in separate columns, so a host
+   compacting its shard writes back only what it journaled itself. */
+
+#define SHARD_NAME_MAX 64
+
+struct shard_stamp
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;              // bytes of the shard merged in
+    char name[SHARD_NAME_MAX];  // host name, NUL-terminated
+};
+
+static int shard_mode = 0;
+static char shard_dir[PATH_MAX - 2 * SHARD_NAME_MAX];
+static char shard_name[SHARD_NAME_MAX];   // this host's
+static struct shard_stamp *peers = NULL;  // merged so far, sorted by name
+static int peer_count = 0;
+
+/* Binary index (~/.xcd_memory.idx).  When present it is mmap'd and its
+   entries are read in place: paths from its string pool, visits from its
+   columns (see column_map()), so loading costs no parsing and nothing per
+   entry; offsets are bounds-checked as they are used.  The plain-text file
+   stays authoritative.  Since that file is an append-only journal, the
+   index describes a prefix of it: the file's identity (dev/inode), the
+   prefix length and a hash of the prefix's last bytes.  Records appended
+   past the prefix are parsed on top of the mapped entries; a compacted or hand-edited file makes the index
+   stale and it is rebuilt from the text.  With shards, the index is also
+   the merged snapshot of the peers: it records how much of each one it
+   covers, and their columns. */
+
+#define INDEX_MAGIC      "XCDIDX1"
+#define INDEX_VERSION    10
+#define INDEX_TAIL_BYTES 64
+#define INDEX_TAIL_MIN   256  // records past the index before rebuilding it
+#define INDEX_TAIL_SHIFT 4    // ... or a sixteenth of its entries, if more
+
+struct index_header
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t count;      // entries in the offset table
+    uint64_t pool_size;  // bytes in the string pool
+    uint64_t src_dev;    // ~/.xcd_memory the index was built from
+    uint64_t src_ino;
+    uint64_t src_size;   // bytes of it covered by the index
+    uint32_t src_tail;   // hash of the last INDEX_TAIL_BYTES of those
+    uint32_t tri_count;  // distinct basename trigrams
+    uint32_t post_count; // postings across all trigrams
+    uint32_t slot_count; // dedup table slots, power of two
+    uint64_t base_size;  // bytes in the basename column, padding included
+    uint32_t node_count; // path trie nodes
+    uint32_t name_size;  // bytes of trie component names, padding included
+    uint32_t peer_count; // peer shards merged in, 0 without shards
+    uint32_t own_count;  // entries not marked peer-only
+    uint32_t name_node_count; // node_count, or 0 if some path is not in the trie
+    uint32_t reserved;
+};
+
+struct index_trigram
+{
+    uint32_t key;    // three basename bytes, first byte highest
+    uint32_t start;  // first posting; the list runs to the next start
+};
+
+struct trie_node
+{
+    uint32_t name;   // offset of the component in the name table
+    uint32_t size;   // nodes in the subtree, this one included
+    int32_t  entry;  // index entry with this path, or -1
+};
+
+struct name_node     // the trie's nodes by name, then by position
+{
+    uint32_t node;
+    uint32_t size;   // its size, so a name's subtrees are read in one pass
+};
+
+/* File layout:  header | struct shard_stamp peers[peer_count]
+                        | struct dir_inode inodes[count]
+                        | uint32_t offsets[count]
+                        | uint32_t visits[count] | uint32_t last[count]
+                        | uint32_t peer_visits[count] | peer_last[count]
+                        | uint32_t base_start[count + 1]
+                        | struct dir_slot slots[slot_count]
+                        | struct dir_slot inode_slots[slot_count]
+                        | struct index_trigram trigrams[tri_count] (by key)
+                        | uint32_t postings[post_count]
+                        | struct trie_node nodes[node_count] (depth first)
+                        | struct name_node name_nodes[name_node_count]
+                        | names[name_size] (trie components, NUL-terminated,
+                          then BASE_PAD zeros)
+                        | unsigned char peer[count]
+                        | basenames (NUL-terminated, then BASE_PAD zeros)
+                        | pool (NUL-terminated paths)
+   The peer columns are there only when peer_count > 0.  The inode column
+   and its slots are mapped writable: what later runs learn is stored
+   straight into them. */
+
+struct dir_slot
+{
+    uint32_t hash;  // full hash, so mismatches rarely touch the path
+    int32_t  idx;   // dirs[] index, -1 when empty
+};
+
+static char *index_map = NULL;
+static size_t index_map_len = 0;
+static int index_enabled = 0;   // index file exists (or -x asked for one)
+static int index_dirty = 0;     // index exists but does not match the text file
+static int index_inline = 0;    // rebuild it in this process (the server)
+static int index_count = 0;     // entries [0 .. index_count) came from the index
+static const uint32_t *index_offsets = NULL;  // of each entry's path in the pool
+static const char *index_pool = NULL;
+static uint64_t index_pool_size = 0;
+static unsigned char *index_dropped = NULL;   // 1: entry found dead since load
+static const struct dir_slot *index_slots = NULL;
+static uint32_t index_slot_count = 0;
+static struct dir_inode *index_inodes = NULL;    // writable when index_writable
+static struct dir_slot *index_inode_slots = NULL;
+static int index_writable = 0;
+static const struct index_trigram *index_trigrams = NULL;
+static const uint32_t *index_postings = NULL;
+static uint32_t index_tri_count = 0;
+static uint32_t index_post_count = 0;
+static const struct trie_node *index_nodes = NULL;
+static uint32_t index_node_count = 0;
+static const struct name_node *index_name_nodes = NULL;  // NULL: none
+static uint32_t index_name_node_count = 0;
+static const char *index_names = NULL;
+static uint32_t index_name_size = 0;            // without the padding
+static const char *index_bases = NULL;        // basename column of the index
+static const uint32_t *index_base_start = NULL;
+
+/* Path arena: strings are bump-allocated out of large chunks that are
+   only ever released all at once. */
+
+#define ARENA_CHUNK (1 << 20)
+
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+static struct arena_chunk *arena = NULL;
+
+/* Tracing (XCD_TRACE=1 or --trace): wall-clock time per phase, and counts
+   of the calls that dominate it, reported on stderr when a command is
+   done.  With XCD_LATENCY_LOG set, every command also appends its times
+   to a log that xcd --stats summarizes.  The counters are always kept;
+   they are a handful of increments. */
+
+enum { PHASE_LOAD, PHASE_MATCH, PHASE_COMMAND, PHASE_SAVE, PHASE_COUNT };
+
+static const char *phase_names[PHASE_COUNT] = { "load", "match", "command", "save" };
+
+struct trace_stats
+{
+    double phase_ms[PHASE_COUNT];
+    unsigned long stats;        // stat() of remembered or memory-file paths
+    unsigned long realpaths;
+    unsigned long opens;
+    unsigned long loaded;       // records read, index entries included
+    unsigned long dropped;      // entries found dead
+    unsigned long long written; // bytes written to the journal and index
+};
+
+static struct trace_stats trace;
+static int trace_enabled = 0;
+static int trace_current = PHASE_COMMAND;
+static double trace_mark = 0;
+
+#define STATS_RECENT  1000          // invocations xcd --stats looks at
+#define STATS_LOG_MAX (256 * 1024)  // log bytes (some 5000 lines) before trimming
 
 /* ---------- Utilities ---------- */
 
+#ifdef XCD_BUILTIN
+static jmp_buf *builtin_abort = NULL;  // set while xcd_builtin() runs
+static pthread_t builtin_thread;
+#endif
+
+// Give up on the command, its message already printed.  The bash builtin
+// must not take the user's shell down with it: there this returns from
+// xcd_builtin() instead, unless it is a gc or crawl thread that gives up.
+static _Noreturn void fatal_exit()
+{
+#ifdef XCD_BUILTIN
+    if (builtin_abort && pthread_equal(pthread_self(), builtin_thread))
+        longjmp(*builtin_abort, 1);
+#endif
+    exit(1);
+}
+
+static void *xrealloc(void *p, size_t n)
+{
+    p = realloc(p, n);
+    if (!p)
+    {
+        fprintf(stderr, "xcd-core: out of memory\n");
+        fatal_exit();
+    }
+    return p;
+}
+
+static char *arena_strdup(const char *s)
+{
+    size_t n = strlen(s) + 1;
+
+    if (!arena || arena->size - arena->used < n)
+    {
+        size_t size = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+        struct arena_chunk *c = xrealloc(NULL, sizeof(*c) + size);
+        c->next = arena;
+        c->used = 0;
+        c->size = size;
+        arena = c;
+    }
+
+    char *p = arena->data + arena->used;
+    memcpy(p, s, n);
+    arena->used += n;
+    return p;
+}
+
+static void arena_free()
+{
+    while (arena)
+    {
+        struct arena_chunk *next = arena->next;
+        free(arena);
+        arena = next;
+    }
+}
+
+// Resize column col, of elements elem bytes wide, to dir_cap elements.  A
+// mapped one stays put while its reservation has room.
+static void *column_grow(void *col, struct column_map *m, size_t elem)
+{
+    size_t bytes = (size_t)dir_cap * elem;
+    if (!m->base)
+        return xrealloc(col, bytes);
+    if ((char *)col + bytes <= (char *)m->base + m->size)
+        return col;
+
+    void *p = xrealloc(NULL, bytes);
+    memcpy(p, col, (size_t)dir_count * elem);
+    munmap(m->base, m->size);
+    m->base = NULL;
+    return p;
+}
+
+// Replace column col with cap zeroed elements, the first count of them
+// mapped from fd at offset off (none when count is 0).
+static void *column_map(void *col, struct column_map *m, int fd, size_t off,
+                        size_t elem, size_t count, size_t cap)
+{
+    if (m->base)
+        munmap(m->base, m->size);
+    else
+        free(col);
+    m->base = NULL;
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t skip = count ? off % page : 0;
+    size_t size = (skip + cap * elem + page - 1) / page * page;
+    char *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (p != MAP_FAILED && count &&
+        mmap(p, skip + count * elem, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fd, (off_t)(off - skip)) == MAP_FAILED)
+    {
+        munmap(p, size);
+        p = MAP_FAILED;
+    }
+
+    if (p == MAP_FAILED)
+    {
+        // read it in instead
+        p = xrealloc(NULL, cap * elem);
+        memset(p, 0, cap * elem);
+        if (count && pread(fd, p, count * elem, (off_t)off) != (ssize_t)(count * elem))
+            memset(p, 0, count * elem);
+        return p;
+    }
+
+    m->base = p;
+    m->size = size;
+    return p + skip;
+}
+
+static void reserve_dirs(int n)
+{
+    if (n <= dir_cap)
+        return;
+
+    dir_cap = dir_cap ? dir_cap : 1024;
+    while (dir_cap < n)
+        dir_cap *= 2;
+
+    dirs = xrealloc(dirs, (size_t)dir_cap * sizeof(dirs[0]));
+    dir_visits = column_grow(dir_visits, &visits_map, sizeof(dir_visits[0]));
+    dir_last = column_grow(dir_last, &last_map, sizeof(dir_last[0]));
+    dir_peer_visits = column_grow(dir_peer_visits, &peer_visits_map,
+                                  sizeof(dir_peer_visits[0]));
+    dir_peer_last = column_grow(dir_peer_last, &peer_last_map, sizeof(dir_peer_last[0]));
+    dir_peer = column_grow(dir_peer, &peer_map, sizeof(dir_peer[0]));
+    dir_inodes = xrealloc(dir_inodes, (size_t)dir_cap * sizeof(dir_inodes[0]));
+}
+
+static const char *base_name(const char *path)
+{
+    const char *base = strrchr(path, '/');
+    return base ? base + 1 : path; // skip '/'
+}
+
+// Add path's basename to the end of the basename column.
+static void base_append(const char *path)
+{
+    const char *base = base_name(path);
+    size_t n = strlen(base) + 1;
+
+    if (base_count + 2 > base_start_cap)
+    {
+        base_start_cap = base_start_cap ? base_start_cap * 2 : 1024;
+        base_start = xrealloc(base_start, (size_t)base_start_cap * sizeof(base_start[0]));
+    }
+
+    if (base_len + n + BASE_PAD > base_buf_cap)
+    {
+        base_buf_cap = base_buf_cap ? base_buf_cap * 2 : 1 << 16;
+        while (base_len + n + BASE_PAD > base_buf_cap)
+            base_buf_cap *= 2;
+        base_buf = xrealloc(base_buf, base_buf_cap);
+    }
+
+    base_start[base_count] = (uint32_t)base_len;
+    memcpy(base_buf + base_len, base, n);
+    base_len += n;
+    base_start[++base_count] = (uint32_t)base_len;
+    memset(base_buf + base_len, 0, BASE_PAD);
+}
+
+static int append_dir(char *path)
+{
+    reserve_dirs(dir_count + 1);
+    base_append(path);
+    dirs[dir_count] = path;
+    dir_visits[dir_count] = 0;
+    dir_last[dir_count] = 0;
+    dir_peer_visits[dir_count] = 0;
+    dir_peer_last[dir_count] = 0;
+    dir_peer[dir_count] = 0;
+    dir_inodes[dir_count].dev = 0;
+    dir_inodes[dir_count].ino = 0;
+    own_count++;
+    return dir_count++;
+}
+
+// Whether entry i is still there; cheaper than entry_path() for scans.
+static int entry_live(int i)
+{
+    return (i < index_count) ? !index_dropped[i] : dirs[i] != NULL;
+}
+
+// Entry i's full path, or NULL once it has been dropped.  A damaged
+// offset reads as "", which no stat() finds, so the entry is dropped as
+// soon as it is checked.
+static const char *entry_path(int i)
+{
+    if (i >= index_count)
+        return dirs[i];
+    if (index_dropped[i])
+        return NULL;
+    return index_offsets[i] < index_pool_size ? index_pool + index_offsets[i] : "";
+}
+
+// Mark entry i gone, wherever its path lives.
+static void clear_entry(int i)
+{
+    if (i < index_count)
+        index_dropped[i] = 1;
+    else
+        dirs[i] = NULL;
+}
+
+// Set entry i's peer flag, keeping own_count in step.
+static void set_peer(int i, unsigned char peer)
+{
+    own_count += (dir_peer[i] != 0) - (peer != 0);
+    dir_peer[i] = peer;
+}
+
 static const char *get_home()
 {
     const char *home = getenv("HOME");
@@ -38,410 +544,6335 @@ static const char *get_home()
         return pw->pw_dir;
 
     fprintf(stderr, "xcd-core: cannot determine HOME\n");
-    exit(1);
+    fatal_exit();
+}
+
+static int stat_dir(const char *path, struct stat *st)
+{
+    trace.stats++;
+    if (stat(path, st) != 0)
+        return 0;
+    return S_ISDIR(st->st_mode);
 }
 
 static int is_dir(const char *path)
 {
     struct stat st;
-    if (stat(path, &st) != 0)
-        return 0;
-    return S_ISDIR(st.st_mode);
+    return stat_dir(path, &st);
 }
 
 static char *canonical_path(const char *path, char *buf, size_t buflen)
 {
+    trace.realpaths++;
     if (!realpath(path, buf))
         return NULL;
     buf[buflen - 1] = '\0';
     return buf;
 }
 
-static void free_memory_list()
+/* ---------- Tracing ---------- */
+
+static double clock_ms()
 {
-    for (int i = 0; i < dir_count; i++)
-        free(dirs[i]);
-    dir_count = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
 }
 
-static int contains_dir(const char *path)
+// Charge the time since the last switch to the current phase and move on
+// to `phase`.  Returns the phase we were in, for nesting.
+static int trace_phase(int phase)
 {
-    for (int i = 0; i < dir_count; i++)
-        if (strcmp(dirs[i], path) == 0)
-            return 1;
-    return 0;
+    double now = clock_ms();
+    trace.phase_ms[trace_current] += now - trace_mark;
+    trace_mark = now;
+
+    int prev = trace_current;
+    trace_current = phase;
+    return prev;
 }
 
-/* ---------- Load / Save memory ---------- */
+// Start timing a command (in the load phase); strips a leading --trace.
+static void trace_begin(int *argc, char **argv)
+{
+    memset(&trace, 0, sizeof(trace));
 
-static void load_memory()
+    const char *env = getenv("XCD_TRACE");
+    trace_enabled = env && *env && strcmp(env, "0") != 0;
+
+    if (*argc >= 2 && strcmp(argv[1], "--trace") == 0)
+    {
+        trace_enabled = 1;
+        memmove(&argv[1], &argv[2], (size_t)(*argc - 1) * sizeof(argv[0]));
+        (*argc)--;
+    }
+
+    trace_current = PHASE_LOAD;
+    trace_mark = clock_ms();
+}
+
+// $XCD_LATENCY_LOG if it names a path, ~/.xcd_latency for any other value.
+static void latency_log_path(char *buf, size_t size)
 {
-    const char *home = get_home();
-    snprintf(memory_file, sizeof(memory_file), "%s/.xcd_memory", home);
-    memory_file[sizeof(memory_file) - 1] = '\0';
+    const char *env = getenv("XCD_LATENCY_LOG");
+    if (env && strchr(env, '/'))
+        snprintf(buf, size, "%s", env);
+    else
+        snprintf(buf, size, "%s/.xcd_latency", get_home());
+}
 
-    FILE *f = fopen(memory_file, "r");
-    if (!f)
-        return; // no file yet, that's fine
+// The last `want` lines of the latency log open at fd, in a malloc'd,
+// NUL-terminated buffer (NULL on error).  Only the end of the file is
+// read, going further back only while that holds fewer lines.
+static char *latency_tail(int fd, int want, size_t *len)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return NULL;
+    size_t size = (size_t)st.st_size;
 
-    char line[PATH_MAX];
+    for (size_t window = (size_t)want * 64; ; window *= 2)
+    {
+        if (window > size)
+            window = size;
+        char *buf = xrealloc(NULL, window + 1);
+        if (pread(fd, buf, window, (off_t)(size - window)) != (ssize_t)window)
+        {
+            free(buf);
+            return NULL;
+        }
+
+        // back from the end, past the last line's own newline
+        size_t p = window;
+        int lines = 0;
+        if (p > 0 && buf[p - 1] == '\n')
+            p--;
+        while (p > 0 && !(buf[p - 1] == '\n' && ++lines == want))
+            p--;
+
+        if (lines == want || window == size)
+        {
+            memmove(buf, buf + p, window - p);
+            *len = window - p;
+            buf[*len] = '\0';
+            return buf;
+        }
+        free(buf);
+    }
+}
+
+// Cut the log at path, open at fd, down to its last STATS_RECENT lines.
+// Samples appended while this runs may be lost; one process trims at a time.
+static void latency_trim(int fd, const char *path)
+{
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+        return;
 
-    while (dir_count < MAX_DIRS && fgets(line, sizeof(line), f))
+    size_t len;
+    char *tail = latency_tail(fd, STATS_RECENT, &len);
+    char tmp[PATH_MAX + 16];
+    snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+    int out = tail ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+    if (out >= 0)
     {
-        char *nl = strchr(line, '\n');
-        if (nl)
-            *nl = '\0';
+        int ok = write(out, tail, len) == (ssize_t)len;
+        close(out);
+        if (!ok || rename(tmp, path) != 0)
+            unlink(tmp);
+    }
+    free(tail);
+}
 
-        if (line[0] == '\0')
-            continue;
+static void trace_end(int argc, char **argv)
+{
+    trace_phase(PHASE_COMMAND);
 
-        if (!is_dir(line))
-            continue;
+    double total = 0;
+    for (int p = 0; p < PHASE_COUNT; p++)
+        total += trace.phase_ms[p];
 
-        char canon[PATH_MAX];
-        if (!canonical_path(line, canon, sizeof(canon)))
-            continue;
+    if (trace_enabled)
+    {
+        fprintf(stderr, "xcd-core: trace: %.3f ms total:", total);
+        for (int p = 0; p < PHASE_COUNT; p++)
+            fprintf(stderr, " %s %.3f", phase_names[p], trace.phase_ms[p]);
+        fprintf(stderr, "\n");
+        fprintf(stderr, "xcd-core: trace: stat %lu, realpath %lu, open %lu; "
+                "entries loaded %lu, dropped %lu; bytes written %llu\n",
+                trace.stats, trace.realpaths, trace.opens,
+                trace.loaded, trace.dropped, trace.written);
+    }
+
+    const char *env = getenv("XCD_LATENCY_LOG");
+    if (!env || !*env || strcmp(env, "0") == 0)
+        return;
+
+    // time, total, each phase, what was run; one O_APPEND write per line
+    const char *what = (argc >= 2 && argv[1][0] == '-') ? argv[1] : "navigate";
+    char line[256];
+    int n = snprintf(line, sizeof(line), "%ld\t%.3f", (long)time(NULL), total);
+    for (int p = 0; p < PHASE_COUNT; p++)
+        n += snprintf(line + n, sizeof(line) - (size_t)n, "\t%.3f", trace.phase_ms[p]);
+    n += snprintf(line + n, sizeof(line) - (size_t)n, "\t%.32s\n", what);
+
+    char path[PATH_MAX];
+    latency_log_path(path, sizeof(path));
+    int fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0666);
+    if (fd < 0)
+        return;
+    if (write(fd, line, (size_t)n) != n)
+    {
+        // a lost sample is not worth an error on every cd
+    }
+
+    // --stats only looks at the end: keep a few times that much.
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > STATS_LOG_MAX)
+        latency_trim(fd, path);
+    close(fd);
+}
+
+/* ---------- Substring kernel ---------- */
+
+/* Scans look for a segment in one contiguous buffer of basenames, each
+   followed by a NUL, rather than calling strstr() per entry.  The SIMD
+   kernels compare the segment's first and last bytes against 16 (SSE2)
+   or 32 (AVX2) candidate positions at once and only memcmp() the
+   positions where both agree.  A NUL never occurs in a segment, so a hit
+   can never straddle two basenames and the results are exactly those of
+   the per-entry strstr() loop.  AVX2 is picked at run time when the CPU
+   has it; other architectures use the scalar kernel. */
+
+typedef size_t (*find_kernel_fn)(const char *buf, size_t len,
+                                 const char *seg, size_t seg_len, size_t from);
+
+// First occurrence of seg in buf[from .. len), or len if there is none.
+static size_t find_scalar(const char *buf, size_t len,
+                          const char *seg, size_t seg_len, size_t from)
+{
+    while (from + seg_len <= len)
+    {
+        const char *p = memchr(buf + from, seg[0], len - seg_len + 1 - from);
+        if (!p)
+            break;
+        size_t i = (size_t)(p - buf);
+        if (memcmp(p + 1, seg + 1, seg_len - 1) == 0)
+            return i;
+        from = i + 1;
+    }
+    return len;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static size_t find_sse2(const char *buf, size_t len,
+                        const char *seg, size_t seg_len, size_t from)
+{
+    const __m128i first = _mm_set1_epi8(seg[0]);
+    const __m128i last = _mm_set1_epi8(seg[seg_len - 1]);
+
+    for (size_t i = from; i + seg_len <= len; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(buf + i + seg_len - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
 
-        if (!contains_dir(canon))
+        while (mask)
         {
-            dirs[dir_count] = strdup(canon);
-            if (!dirs[dir_count])
-            {
-                fprintf(stderr, "xcd-core: out of memory\n");
-                fclose(f);
-                exit(1);
-            }
-            dir_count++;
+            size_t k = i + (size_t)__builtin_ctz(mask);
+            if (k + seg_len > len)
+                return len;
+            if (memcmp(buf + k + 1, seg + 1, seg_len - 1) == 0)
+                return k;
+            mask &= mask - 1;
+        }
+    }
+    return len;
+}
+
+__attribute__((target("avx2")))
+static size_t find_avx2(const char *buf, size_t len,
+                        const char *seg, size_t seg_len, size_t from)
+{
+    const __m256i first = _mm256_set1_epi8(seg[0]);
+    const __m256i last = _mm256_set1_epi8(seg[seg_len - 1]);
+
+    for (size_t i = from; i + seg_len <= len; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(buf + i + seg_len - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+        while (mask)
+        {
+            size_t k = i + (size_t)__builtin_ctz(mask);
+            if (k + seg_len > len)
+                return len;
+            if (memcmp(buf + k + 1, seg + 1, seg_len - 1) == 0)
+                return k;
+            mask &= mask - 1;
+        }
+    }
+    return len;
+}
+
+static find_kernel_fn pick_kernel()
+{
+    if (getenv("XCD_NO_SIMD"))
+        return find_scalar;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return find_avx2;
+    return find_sse2;
+}
+
+#else
+
+static find_kernel_fn pick_kernel()
+{
+    return find_scalar;
+}
+
+#endif
+
+static find_kernel_fn find_kernel = NULL;
+
+static void push_match(int **indices, int *count, int *cap, int i)
+{
+    if (*count == *cap)
+    {
+        *cap *= 2;
+        *indices = xrealloc(*indices, (size_t)*cap * sizeof((*indices)[0]));
+    }
+    (*indices)[(*count)++] = i;
+}
+
+// Entry i's basename, from the column that holds it.
+static const char *entry_base(int i)
+{
+    if (i < index_count)
+    {
+        // the column ends in BASE_PAD zeros, checked at load
+        uint32_t start = index_base_start[i];
+        return start < index_base_start[index_count] ? index_bases + start : "";
+    }
+    return base_buf + base_start[i - index_count];
+}
+
+// Append the entries first + e, e in [from, count), of a basename column
+// whose basename contains segment, in order.
+static void scan_column(const char *buf, size_t len, const uint32_t *start,
+                        int first, int count, int from, const char *segment,
+                        size_t seg_len, int **indices, int *n, int *cap)
+{
+    size_t pos = start[from];
+    int e = from;
+
+    while (e < count &&
+           (pos = find_kernel(buf, len, segment, seg_len, pos)) < len)
+    {
+        // entry holding pos: last e with start[e] <= pos
+        int lo = e, hi = count;
+        while (hi - lo > 1)
+        {
+            int mid = lo + (hi - lo) / 2;
+            if (start[mid] <= pos)
+                lo = mid;
+            else
+                hi = mid;
         }
+        e = lo;
+
+        if (entry_live(first + e))
+            push_match(indices, n, cap, first + e);
+
+        // one hit per entry: resume at the next basename (a column that
+        // does not go forward is damaged: stop rather than loop)
+        size_t next = start[++e];
+        if (next <= pos)
+            break;
+        pos = next;
+    }
+}
+
+// Append the entries in dirs[from .. dir_count) whose basename contains
+// segment, in order.
+static void scan_matches(const char *segment, int from,
+                         int **indices, int *count, int *cap)
+{
+    size_t seg_len = strlen(segment);
+
+    if (seg_len == 0)
+    {
+        for (int i = from; i < dir_count; i++)
+            if (entry_live(i))
+                push_match(indices, count, cap, i);
+        return;
+    }
+
+    if (!find_kernel)
+        find_kernel = pick_kernel();
+
+    if (from < index_count)
+        scan_column(index_bases, index_base_start[index_count], index_base_start,
+                    0, index_count, from, segment, seg_len, indices, count, cap);
+
+    if (base_count > 0)
+        scan_column(base_buf, base_len, base_start, index_count, base_count,
+                    from > index_count ? from - index_count : 0,
+                    segment, seg_len, indices, count, cap);
+}
+
+/* ---------- Approximate matching ---------- */
+
+/* A segment that matches no basename exactly is matched approximately: a
+   basename is accepted if the segment is a subsequence of it ("bknd" in
+   "backend") or if some substring of it is within a few edits of the
+   segment ("bakend").  Both ignore ASCII case.  Edit distances come from
+   Myers' bit-parallel algorithm: the segment's columns of the DP matrix
+   live in one 64-bit word, so each basename byte costs a handful of word
+   operations.  This pass only runs when there is no exact match, so exact
+   matches always rank first. */
+
+#define FUZZY_MAX 64  // longest segment that fits the bit vectors
+
+struct fuzzy
+{
+    uint64_t peq[256];      // bit j set where seg[j] equals the byte
+    unsigned char seg[FUZZY_MAX];
+    uint64_t chars;         // char_bit() of every byte of seg
+    int len;
+    int edits;              // edits allowed; 0 means subsequence only
+};
+
+static unsigned char fold(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c - 'A' + 'a') : c;
+}
+
+// A set of (case-folded) bytes as a bit mask; distinct bytes may share a
+// bit, which only makes the filter below let more through.
+static uint64_t char_bit(unsigned char c)
+{
+    return 1ULL << (fold(c) & 63);
+}
+
+static void fuzzy_init(struct fuzzy *f, const char *segment)
+{
+    size_t n = strlen(segment);
+
+    memset(f->peq, 0, sizeof(f->peq));
+    f->chars = 0;
+    f->len = (n > FUZZY_MAX) ? FUZZY_MAX : (int)n;
+    for (int j = 0; j < f->len; j++)
+    {
+        unsigned char c = fold((unsigned char)segment[j]);
+        f->seg[j] = c;
+        f->chars |= char_bit(c);
+        f->peq[c] |= 1ULL << j;
+        if (c >= 'a' && c <= 'z')
+            f->peq[c - 'a' + 'A'] |= 1ULL << j;
+    }
+
+    // one typo in a short segment, two in a long one; too short for any
+    if (f->len < 4)
+        f->edits = 0;
+    else
+        f->edits = (f->len < 8) ? 1 : 2;
+}
+
+static int fuzzy_match(const struct fuzzy *f, const char *s, int n)
+{
+    if (n < f->len - f->edits)
+        return 0;
+
+    // Each segment byte missing from s costs at least one edit, and a
+    // subsequence can miss none: most basenames stop here.
+    uint64_t chars = 0;
+    for (int i = 0; i < n; i++)
+        chars |= char_bit((unsigned char)s[i]);
+    if (__builtin_popcountll(f->chars & ~chars) > f->edits)
+        return 0;
+
+    int j = 0;
+    for (int i = 0; i < n && j < f->len; i++)
+        if (fold((unsigned char)s[i]) == f->seg[j])
+            j++;
+    if (j == f->len)
+        return 1;
+    if (f->edits == 0)
+        return 0;
+
+    // Myers: pv/mv are the +1/-1 vertical deltas of the current column;
+    // score is the distance of the whole segment ending at s[i].  The top
+    // row stays 0 (a match may start anywhere), so nothing shifts into ph.
+    uint64_t pv = ~0ULL, mv = 0;
+    uint64_t high = 1ULL << (f->len - 1);
+    int score = f->len;
+
+    for (int i = 0; i < n; i++)
+    {
+        uint64_t eq = f->peq[(unsigned char)s[i]];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+
+        if (ph & high)
+            score++;
+        else if (mh & high)
+            score--;
+        if (score <= f->edits)
+            return 1;
+
+        ph <<= 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+    }
+    return 0;
+}
+
+// Append the entries first + e, e in [from, count), of a basename column
+// that match f approximately, in order.
+static void fuzzy_column(const struct fuzzy *f, const char *buf,
+                         const uint32_t *start, int first, int count, int from,
+                         int **indices, int *n, int *cap)
+{
+    for (int e = from; e < count; e++)
+        if (start[e] < start[e + 1] && start[e + 1] <= start[count] &&
+            entry_live(first + e) &&
+            fuzzy_match(f, buf + start[e], (int)(start[e + 1] - start[e] - 1)))
+            push_match(indices, n, cap, first + e);
+}
+
+// Indices of entries whose basename matches segment approximately, in a
+// malloc'd array the caller frees.
+static int fuzzy_matches(const char *segment, int **out_indices)
+{
+    int count = 0;
+    int cap = 64;
+    int *indices = xrealloc(NULL, (size_t)cap * sizeof(indices[0]));
+
+    *out_indices = indices;
+    if (strlen(segment) > FUZZY_MAX)
+        return 0;
+
+    int prev = trace_phase(PHASE_MATCH);
+    struct fuzzy f;
+    fuzzy_init(&f, segment);
+
+    if (index_count > 0)
+        fuzzy_column(&f, index_bases, index_base_start, 0, index_count, 0,
+                     &indices, &count, &cap);
+    if (base_count > 0)
+        fuzzy_column(&f, base_buf, base_start, index_count, base_count, 0,
+                     &indices, &count, &cap);
+
+    trace_phase(prev);
+    *out_indices = indices;
+    return count;
+}
+
+/* ---------- Dedup set ---------- */
+
+/* Open-addressing (linear probing) hash set of dirs[] indices keyed on the
+   path, so dedup in load_memory() and remember_dir() is O(1) instead of a
+   scan over every entry.  The table is kept at most half full.  Entries
+   that came from the binary index are found through the table stored in
+   it; this one covers dirs[index_count .. dir_set_indexed) and catches up
+   lazily.  Slots of dropped entries (dirs[i] == NULL) never match but
+   keep probe chains intact. */
+
+static struct dir_slot *dir_set = NULL;
+static size_t dir_set_cap = 0;     // number of slots, power of two
+static int dir_set_indexed = 0;
+
+// The same for (dev, inode) pairs, filled as entries' inodes are learned.
+static struct dir_slot *inode_set = NULL;
+static size_t inode_set_cap = 0;
+static size_t inode_set_used = 0;
+
+static uint32_t hash_path(const char *s)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    while (*s)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t hash_bytes(const char *p, size_t n)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    while (n--)
+    {
+        h ^= (unsigned char)*p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void slot_place(struct dir_slot *slots, size_t cap, uint32_t h, int i)
+{
+    size_t mask = cap - 1;
+    size_t slot = h & mask;
+    while (slots[slot].idx >= 0)
+        slot = (slot + 1) & mask;
+    slots[slot].hash = h;
+    slots[slot].idx = i;
+}
+
+static int slot_find(const struct dir_slot *slots, size_t cap, uint32_t h,
+                     const char *path)
+{
+    size_t mask = cap - 1;
+    for (size_t slot = h & mask; slots[slot].idx >= 0; slot = (slot + 1) & mask)
+    {
+        if (slots[slot].hash != h || slots[slot].idx >= dir_count)
+            continue;
+        const char *d = entry_path(slots[slot].idx);
+        if (d && strcmp(d, path) == 0)
+            return slots[slot].idx;
+    }
+    return -1;
+}
+
+static void dir_set_place(int i)
+{
+    slot_place(dir_set, dir_set_cap, hash_path(dirs[i]), i);
+}
+
+static void dir_set_reserve(size_t n)
+{
+    if (dir_set && n * 2 <= dir_set_cap)
+        return;
+
+    size_t cap = dir_set_cap ? dir_set_cap : 1024;
+    while (n * 2 > cap)
+        cap *= 2;
+
+    free(dir_set);
+    dir_set = xrealloc(NULL, cap * sizeof(dir_set[0]));
+    memset(dir_set, 0xff, cap * sizeof(dir_set[0]));
+    dir_set_cap = cap;
+
+    // rehash everything indexed so far
+    for (int i = index_count; i < dir_set_indexed; i++)
+        if (dirs[i])
+            dir_set_place(i);
+}
+
+static void dir_set_sync()
+{
+    if (dir_set_indexed < index_count)
+        dir_set_indexed = index_count;
+    dir_set_reserve((size_t)(dir_count - index_count));
+    for (; dir_set_indexed < dir_count; dir_set_indexed++)
+        if (dirs[dir_set_indexed])
+            dir_set_place(dir_set_indexed);
+}
+
+static void free_memory_list()
+{
+    arena_free();
+    dir_count = 0;
+    index_count = 0;
+    own_count = 0;
+    index_offsets = NULL;
+    index_pool = NULL;
+    index_pool_size = 0;
+    free(index_dropped);
+    index_dropped = NULL;
+    index_slots = NULL;
+    index_inodes = NULL;
+    index_inode_slots = NULL;
+    index_nodes = NULL;
+    index_name_nodes = NULL;
+    index_names = NULL;
+    index_bases = NULL;
+    index_base_start = NULL;
+    base_count = 0;
+    base_len = 0;
+    visit_log_count = 0;
+    peer_count = 0;
+
+    if (dir_set)
+        memset(dir_set, 0xff, dir_set_cap * sizeof(dir_set[0]));
+    dir_set_indexed = 0;
+    if (inode_set)
+        memset(inode_set, 0xff, inode_set_cap * sizeof(inode_set[0]));
+    inode_set_used = 0;
+}
+
+// dirs[] index of path, or -1 if it is not remembered.
+static int find_dir(const char *path)
+{
+    uint32_t h = hash_path(path);
+
+    if (index_slots)
+    {
+        int i = slot_find(index_slots, index_slot_count, h, path);
+        if (i >= 0)
+            return i;
+    }
+
+    dir_set_sync();
+    return slot_find(dir_set, dir_set_cap, h, path);
+}
+
+static void drop_dir(int i);
+
+static uint32_t hash_inode(uint64_t dev, uint64_t ino)
+{
+    uint64_t k = (dev * 0x9e3779b97f4a7c15ULL) ^ ino; // splitmix64 finalizer
+    k ^= k >> 30;
+    k *= 0xbf58476d1ce4e5b9ULL;
+    k ^= k >> 27;
+    k *= 0x94d049bb133111ebULL;
+    k ^= k >> 31;
+    return (uint32_t)k;
+}
+
+static struct dir_inode *entry_inode(int i)
+{
+    return (i < index_count) ? &index_inodes[i] : &dir_inodes[i];
+}
+
+static int inode_slot_find(const struct dir_slot *slots, size_t cap, uint32_t h,
+                           uint64_t dev, uint64_t ino)
+{
+    size_t mask = cap - 1;
+    size_t slot = h & mask;
+    for (size_t n = 0; n < cap && slots[slot].idx >= 0; n++, slot = (slot + 1) & mask)
+    {
+        int i = slots[slot].idx;
+        if (slots[slot].hash != h || i >= dir_count || !entry_path(i))
+            continue;
+        const struct dir_inode *e = entry_inode(i);
+        if (e->ino == ino && e->dev == dev)
+            return i;
+    }
+    return -1;
+}
+
+static void inode_set_place(int i)
+{
+    const struct dir_inode *e = &dir_inodes[i];
+    slot_place(inode_set, inode_set_cap, hash_inode(e->dev, e->ino), i);
+    inode_set_used++;
+}
+
+// Record that entry i is the directory st describes.
+static void set_inode(int i, const struct stat *st)
+{
+    uint64_t dev = (uint64_t)st->st_dev, ino = (uint64_t)st->st_ino;
+    if (i < index_count && !index_writable)
+        return;
+
+    struct dir_inode *e = entry_inode(i);
+    if (e->dev == dev && e->ino == ino)
+        return;
+    e->dev = dev;
+    e->ino = ino;
+    uint32_t h = hash_inode(dev, ino);
+
+    if (i < index_count)
+    {
+        // Into the mapped table, which save_index() sized to stay at most
+        // half full.  Another run may be doing the same: the slot's index
+        // is published last, and a lost update only costs a realpath().
+        size_t mask = index_slot_count - 1;
+        size_t slot = h & mask;
+        for (int n = 0; n < 64; n++, slot = (slot + 1) & mask)
+            if (index_inode_slots[slot].idx < 0)
+            {
+                index_inode_slots[slot].hash = h;
+                __atomic_store_n(&index_inode_slots[slot].idx, i, __ATOMIC_RELEASE);
+                break;
+            }
+        return;
+    }
+
+    if ((inode_set_used + 1) * 2 > inode_set_cap)
+    {
+        size_t cap = inode_set_cap ? inode_set_cap * 2 : 256;
+        free(inode_set);
+        inode_set = xrealloc(NULL, cap * sizeof(inode_set[0]));
+        memset(inode_set, 0xff, cap * sizeof(inode_set[0]));
+        inode_set_cap = cap;
+        inode_set_used = 0;
+        for (int j = index_count; j < dir_count; j++)
+            if (j != i && dirs[j] && dir_inodes[j].ino)
+                inode_set_place(j);
+    }
+    inode_set_place(i);
+}
+
+// dirs[] index of the directory st describes, found by inode, or -1.
+static int find_inode(const struct stat *st)
+{
+    uint64_t dev = (uint64_t)st->st_dev, ino = (uint64_t)st->st_ino;
+    uint32_t h = hash_inode(dev, ino);
+    int i = -1;
+
+    if (index_inode_slots)
+        i = inode_slot_find(index_inode_slots, index_slot_count, h, dev, ino);
+    if (i < 0 && inode_set)
+        i = inode_slot_find(inode_set, inode_set_cap, h, dev, ino);
+    if (i < 0)
+        return -1;
+
+    // Inodes are reused once a directory is deleted: check that the
+    // entry's path still leads here.  One stat() is still much cheaper
+    // than the realpath() it saves.
+    struct stat est;
+    if (stat_dir(entry_path(i), &est))
+    {
+        if (est.st_dev == st->st_dev && est.st_ino == st->st_ino)
+            return i;
+        set_inode(i, &est); // recreated since: a different directory now
+    }
+    else
+    {
+        drop_dir(i);
+    }
+    return -1;
+}
+
+/* Entries are trusted when loaded; they are only checked against the
+   filesystem once they become candidates (a navigation target or a row
+   that is about to be printed).  A dead entry is dropped by marking it
+   (entry_path() is then NULL), and save_memory() leaves it out of the
+   file. */
+
+static void drop_dir(int i)
+{
+    clear_entry(i); // its bytes stay in the arena/index until exit
+    if (!dir_peer[i])
+        own_count--;
+    trace.dropped++;
+    memory_dirty = 1;
+    compact_needed = 1; // removals need a rewrite, not an append
+}
+
+static int check_dir(int i)
+{
+    struct stat st;
+    if (stat_dir(entry_path(i), &st))
+    {
+        set_inode(i, &st);
+        return 1;
+    }
+    drop_dir(i);
+    return 0;
+}
+
+/* ---------- Patterns ---------- */
+
+/* xcd -r PATTERN matches basenames against an extended regular expression
+   (. [] * + ? | () ^ $ and \d \w \s), and a segment holding *, ? or [ is
+   a shell glob that must match the whole basename.  Both compile to a
+   Thompson NFA, which runs as a DFA built lazily: a DFA state is the set
+   of NFA states reached, and its transition on a byte is worked out the
+   first time that byte is seen there.  Each basename byte is thus one
+   table lookup once the states it needs exist, and at most one pass over
+   the NFA before: nothing backtracks, so no pattern can take more than
+   linear time.  The DFA lives for one query; a pattern needing more than
+   PATTERN_DFA_MAX states just empties the cache and goes on. */
+
+#define PATTERN_MAX     256   // bytes in a pattern
+#define PATTERN_DFA_MAX 1024  // DFA states cached at once
+
+enum { NFA_EPS, NFA_SPLIT, NFA_CLASS, NFA_BOL, NFA_EOL, NFA_MATCH };
+
+struct nfa_state
+{
+    int type;
+    int out, out1;     // next states; NFA_SPLIT uses both
+    uint64_t cls[4];   // NFA_CLASS: the bytes it accepts
+};
+
+struct dfa_state
+{
+    int *set;          // NFA states reached, sorted: classes, EOLs, MATCH
+    int n;
+    uint32_t hash;
+    int accept;        // a match is complete here
+    int accept_end;    // ... or would be, if the basename ended here
+    int next[256];     // -1 until worked out
+};
+
+struct pattern
+{
+    const char *src;
+    int pos;
+    int glob;
+    const char *error;
+
+    struct nfa_state *nfa;
+    int nfa_count;
+    int nfa_cap;
+    int start;
+
+    struct dfa_state *dfa;
+    int dfa_count;
+    int *slots;        // DFA state + 1 by set hash, 0 when empty
+    int initial;       // DFA state at the start of a basename, -1 if none
+    int flushes;       // times the cache was emptied
+    int *stack;        // scratch for closures
+    int *seen;
+    int seen_gen;
+    int *seeds;
+    int *set;
+};
+
+struct frag
+{
+    int start, end;    // end is an NFA_EPS whose out is still open
+};
+
+static int nfa_add(struct pattern *p, int type, int out, int out1)
+{
+    if (p->nfa_count == p->nfa_cap)
+    {
+        p->nfa_cap = p->nfa_cap ? p->nfa_cap * 2 : 64;
+        p->nfa = xrealloc(p->nfa, (size_t)p->nfa_cap * sizeof(p->nfa[0]));
+    }
+    struct nfa_state *s = &p->nfa[p->nfa_count];
+    memset(s, 0, sizeof(*s));
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    return p->nfa_count++;
+}
+
+static struct frag frag_single(struct pattern *p, int type)
+{
+    struct frag f;
+    f.end = nfa_add(p, NFA_EPS, -1, -1);
+    f.start = nfa_add(p, type, f.end, -1);
+    return f;
+}
+
+static struct frag frag_empty(struct pattern *p)
+{
+    struct frag f;
+    f.start = f.end = nfa_add(p, NFA_EPS, -1, -1);
+    return f;
+}
+
+static struct frag frag_concat(struct pattern *p, struct frag a, struct frag b)
+{
+    p->nfa[a.end].out = b.start;
+    a.end = b.end;
+    return a;
+}
+
+static void class_add(uint64_t *cls, int lo, int hi)
+{
+    for (int c = lo; c <= hi; c++)
+        cls[c >> 6] |= 1ULL << (c & 63);
+}
+
+// \d \w \s, or a plain escaped byte.
+static void class_escape(uint64_t *cls, int c)
+{
+    if (c == 'd')
+        class_add(cls, '0', '9');
+    else if (c == 'w')
+    {
+        class_add(cls, '0', '9');
+        class_add(cls, 'A', 'Z');
+        class_add(cls, 'a', 'z');
+        class_add(cls, '_', '_');
+    }
+    else if (c == 's')
+    {
+        class_add(cls, ' ', ' ');
+        class_add(cls, '\t', '\r');
+    }
+    else
+        class_add(cls, c, c);
+}
+
+// A bracket expression; p->pos is just past the '['.
+static struct frag parse_bracket(struct pattern *p)
+{
+    struct frag f = frag_single(p, NFA_CLASS);
+    uint64_t cls[4] = { 0, 0, 0, 0 };
+    const char *s = p->src;
+    int negate = 0;
+
+    if (s[p->pos] == '^' || (p->glob && s[p->pos] == '!'))
+    {
+        negate = 1;
+        p->pos++;
+    }
+
+    int first = 1;
+    while (s[p->pos] && (s[p->pos] != ']' || first))
+    {
+        int c = (unsigned char)s[p->pos++];
+        first = 0;
+        if (c == '\\' && s[p->pos])
+        {
+            c = (unsigned char)s[p->pos++];
+            if (!p->glob && strchr("dws", c))
+            {
+                class_escape(cls, c);
+                continue;
+            }
+        }
+        if (s[p->pos] == '-' && s[p->pos + 1] && s[p->pos + 1] != ']')
+        {
+            int hi = (unsigned char)s[p->pos + 1];
+            p->pos += 2;
+            if (hi < c)
+            {
+                p->error = "bad range in [...]";
+                return f;
+            }
+            class_add(cls, c, hi);
+        }
+        else
+            class_add(cls, c, c);
+    }
+    if (s[p->pos] != ']')
+    {
+        p->error = "missing ]";
+        return f;
+    }
+    p->pos++;
+
+    for (int k = 0; k < 4; k++)
+        p->nfa[f.start].cls[k] = negate ? ~cls[k] : cls[k];
+    p->nfa[f.start].cls[0] &= ~1ULL; // never NUL
+    return f;
+}
+
+static struct frag parse_alt(struct pattern *p);
+
+static struct frag parse_atom(struct pattern *p)
+{
+    const char *s = p->src;
+    int c = (unsigned char)s[p->pos++];
+    struct frag f;
+
+    if (c == '[')
+        return parse_bracket(p);
+
+    if (p->glob ? c == '?' : c == '.')
+    {
+        f = frag_single(p, NFA_CLASS);
+        class_add(p->nfa[f.start].cls, 1, 255);
+        return f;
+    }
+
+    if (p->glob && c == '*')
+    {
+        // any run: a loop on "any byte"
+        struct frag any = frag_single(p, NFA_CLASS);
+        class_add(p->nfa[any.start].cls, 1, 255);
+        f.end = nfa_add(p, NFA_EPS, -1, -1);
+        f.start = nfa_add(p, NFA_SPLIT, any.start, f.end);
+        p->nfa[any.end].out = f.start;
+        return f;
+    }
+
+    if (!p->glob)
+    {
+        if (c == '(')
+        {
+            f = parse_alt(p);
+            if (!p->error && s[p->pos] != ')')
+                p->error = "missing )";
+            else
+                p->pos++;
+            return f;
+        }
+        if (c == '^')
+            return frag_single(p, NFA_BOL);
+        if (c == '$')
+            return frag_single(p, NFA_EOL);
+        if (c == '*' || c == '+' || c == '?')
+        {
+            p->error = "nothing to repeat";
+            return frag_empty(p);
+        }
+    }
+
+    f = frag_single(p, NFA_CLASS);
+    if (c == '\\' && s[p->pos])
+    {
+        c = (unsigned char)s[p->pos++];
+        if (p->glob)
+            class_add(p->nfa[f.start].cls, c, c);
+        else
+            class_escape(p->nfa[f.start].cls, c);
+    }
+    else
+        class_add(p->nfa[f.start].cls, c, c);
+    return f;
+}
+
+static struct frag parse_repeat(struct pattern *p)
+{
+    struct frag a = parse_atom(p);
+
+    while (!p->glob && !p->error && p->src[p->pos] &&
+           strchr("*+?", p->src[p->pos]))
+    {
+        int op = p->src[p->pos++];
+        int end = nfa_add(p, NFA_EPS, -1, -1);
+        int split = nfa_add(p, NFA_SPLIT, a.start, end);
+
+        if (op == '?')
+            p->nfa[a.end].out = end;
+        else
+            p->nfa[a.end].out = split; // loop back for * and +
+
+        if (op != '+')
+            a.start = split;
+        a.end = end;
+    }
+    return a;
+}
+
+static struct frag parse_concat(struct pattern *p)
+{
+    struct frag f = frag_empty(p);
+
+    while (!p->error && p->src[p->pos] &&
+           (p->glob || (p->src[p->pos] != '|' && p->src[p->pos] != ')')))
+        f = frag_concat(p, f, parse_repeat(p));
+    return f;
+}
+
+static struct frag parse_alt(struct pattern *p)
+{
+    struct frag f = parse_concat(p);
+
+    while (!p->error && p->src[p->pos] == '|')
+    {
+        p->pos++;
+        struct frag b = parse_concat(p);
+        int end = nfa_add(p, NFA_EPS, -1, -1);
+        f.start = nfa_add(p, NFA_SPLIT, f.start, b.start);
+        p->nfa[f.end].out = end;
+        p->nfa[b.end].out = end;
+        f.end = end;
+    }
+    return f;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+static void pattern_free(struct pattern *p)
+{
+    for (int d = 0; d < p->dfa_count; d++)
+        free(p->dfa[d].set);
+    free(p->dfa);
+    free(p->slots);
+    free(p->nfa);
+    free(p->stack);
+    free(p->seen);
+    free(p->seeds);
+    free(p->set);
+}
+
+// Compile src, a regular expression or (glob) a shell glob.  Returns 0,
+// with p->error set, if it is malformed.
+static int pattern_init(struct pattern *p, const char *src, int glob)
+{
+    memset(p, 0, sizeof(*p));
+    p->src = src;
+    p->glob = glob;
+    p->initial = -1;
+
+    if (strlen(src) > PATTERN_MAX)
+    {
+        p->error = "too long";
+        return 0;
+    }
+
+    struct frag f = parse_alt(p);
+    if (!p->error && p->src[p->pos])
+        p->error = "unmatched )";
+    if (p->error)
+        return 0;
+
+    // A glob is anchored at both ends; a regular expression may match
+    // anywhere unless it says otherwise.
+    if (glob)
+    {
+        f = frag_concat(p, frag_single(p, NFA_BOL), f);
+        f = frag_concat(p, f, frag_single(p, NFA_EOL));
+    }
+    p->nfa[f.end].out = nfa_add(p, NFA_MATCH, -1, -1);
+    p->start = f.start;
+
+    p->dfa = xrealloc(NULL, PATTERN_DFA_MAX * sizeof(p->dfa[0]));
+    p->slots = xrealloc(NULL, 2 * PATTERN_DFA_MAX * sizeof(p->slots[0]));
+    memset(p->slots, 0, 2 * PATTERN_DFA_MAX * sizeof(p->slots[0]));
+    // Each state is expanded once and pushes at most two more.
+    size_t n = (size_t)p->nfa_count;
+    p->stack = xrealloc(NULL, (3 * n + 2) * sizeof(p->stack[0]));
+    p->seen = xrealloc(NULL, n * sizeof(p->seen[0]));
+    memset(p->seen, 0, n * sizeof(p->seen[0]));
+    p->seeds = xrealloc(NULL, (n + 1) * sizeof(p->seeds[0]));
+    p->set = xrealloc(NULL, n * sizeof(p->set[0]));
+    return 1;
+}
+
+// Start a new traversal: no state seen yet.
+static void nfa_unsee(struct pattern *p)
+{
+    if (++p->seen_gen == 0)
+    {
+        memset(p->seen, 0, (size_t)p->nfa_count * sizeof(p->seen[0]));
+        p->seen_gen = 1;
+    }
+}
+
+// The NFA states reachable from seeds[0 .. n) without consuming a byte,
+// keeping those that wait for one (classes, EOLs) and MATCH, sorted into
+// set.  BOL holds only at the start of the basename.  Returns the count.
+static int nfa_closure(struct pattern *p, const int *seeds, int n, int bol, int *set)
+{
+    int top = 0;
+    int count = 0;
+
+    nfa_unsee(p);
+    for (int k = 0; k < n; k++)
+        p->stack[top++] = seeds[k];
+
+    while (top > 0)
+    {
+        int s = p->stack[--top];
+        if (s < 0 || p->seen[s] == p->seen_gen)
+            continue;
+        p->seen[s] = p->seen_gen;
+
+        const struct nfa_state *st = &p->nfa[s];
+        switch (st->type)
+        {
+        case NFA_EPS:
+            p->stack[top++] = st->out;
+            break;
+        case NFA_SPLIT:
+            p->stack[top++] = st->out1;
+            p->stack[top++] = st->out;
+            break;
+        case NFA_BOL:
+            if (bol)
+                p->stack[top++] = st->out;
+            break;
+        default:
+            set[count++] = s;
+            break;
+        }
+    }
+
+    qsort(set, (size_t)count, sizeof(set[0]), cmp_int);
+    return count;
+}
+
+// Could the set reach MATCH at the end of the basename, through EOLs?
+static int nfa_accepts_at_end(struct pattern *p, const int *set, int n)
+{
+    int top = 0;
+
+    nfa_unsee(p);
+    for (int k = 0; k < n; k++)
+        p->stack[top++] = set[k];
+
+    while (top > 0)
+    {
+        int s = p->stack[--top];
+        if (s < 0 || p->seen[s] == p->seen_gen)
+            continue;
+        p->seen[s] = p->seen_gen;
+
+        const struct nfa_state *st = &p->nfa[s];
+        switch (st->type)
+        {
+        case NFA_MATCH:
+            return 1;
+        case NFA_SPLIT:
+            p->stack[top++] = st->out1;
+            p->stack[top++] = st->out;
+            break;
+        case NFA_EPS:
+        case NFA_EOL:
+            p->stack[top++] = st->out;
+            break;
+        default:
+            break; // a byte would be needed
+        }
+    }
+    return 0;
+}
+
+// DFA state for set[0 .. n), added if new.  A full cache is emptied
+// first, so earlier state numbers go stale.
+static int dfa_find(struct pattern *p, int *set, int n)
+{
+    uint32_t h = hash_bytes((const char *)set, (size_t)n * sizeof(set[0]));
+    size_t mask = 2 * PATTERN_DFA_MAX - 1;
+    size_t slot = h & mask;
+
+    for (; p->slots[slot]; slot = (slot + 1) & mask)
+    {
+        const struct dfa_state *d = &p->dfa[p->slots[slot] - 1];
+        if (d->hash == h && d->n == n &&
+            memcmp(d->set, set, (size_t)n * sizeof(set[0])) == 0)
+            return p->slots[slot] - 1;
+    }
+
+    if (p->dfa_count == PATTERN_DFA_MAX)
+    {
+        for (int d = 0; d < p->dfa_count; d++)
+            free(p->dfa[d].set);
+        p->dfa_count = 0;
+        p->initial = -1;
+        p->flushes++;
+        memset(p->slots, 0, 2 * PATTERN_DFA_MAX * sizeof(p->slots[0]));
+        slot = h & mask;
+    }
+
+    struct dfa_state *d = &p->dfa[p->dfa_count];
+    d->set = xrealloc(NULL, (size_t)(n ? n : 1) * sizeof(set[0]));
+    memcpy(d->set, set, (size_t)n * sizeof(set[0]));
+    d->n = n;
+    d->hash = h;
+    d->accept = 0;
+    for (int k = 0; k < n; k++)
+        if (p->nfa[set[k]].type == NFA_MATCH)
+            d->accept = 1;
+    d->accept_end = nfa_accepts_at_end(p, set, n);
+    memset(d->next, 0xff, sizeof(d->next));
+
+    p->slots[slot] = p->dfa_count + 1;
+    return p->dfa_count++;
+}
+
+static int dfa_initial(struct pattern *p)
+{
+    if (p->initial < 0)
+    {
+        int n = nfa_closure(p, &p->start, 1, 1, p->set);
+        p->initial = dfa_find(p, p->set, n);
+    }
+    return p->initial;
+}
+
+// Work out (and cache) the transition of DFA state d on byte c.  Every
+// step also restarts the NFA, so an unanchored pattern matches anywhere.
+static int dfa_step(struct pattern *p, int d, unsigned char c)
+{
+    int m = 0;
+
+    for (int k = 0; k < p->dfa[d].n; k++)
+    {
+        const struct nfa_state *st = &p->nfa[p->dfa[d].set[k]];
+        if (st->type == NFA_CLASS && (st->cls[c >> 6] >> (c & 63) & 1))
+            p->seeds[m++] = st->out;
+    }
+    p->seeds[m++] = p->start;
+
+    int n = nfa_closure(p, p->seeds, m, 0, p->set);
+    int flushes = p->flushes;
+    int next = dfa_find(p, p->set, n);
+    if (p->flushes == flushes)
+        p->dfa[d].next[c] = next; // else d is gone
+    return next;
+}
+
+// Does basename s match?  One DFA step per byte, stopping at the first
+// complete match.
+static int pattern_match(struct pattern *p, const char *s)
+{
+    int d = dfa_initial(p);
+
+    for (; *s; s++)
+    {
+        if (p->dfa[d].accept)
+            return 1;
+        if (p->dfa[d].n == 0)
+            return 0; // every state contains the restart; none is left
+        int next = p->dfa[d].next[(unsigned char)*s];
+        d = (next >= 0) ? next : dfa_step(p, d, (unsigned char)*s);
+    }
+    return p->dfa[d].accept || p->dfa[d].accept_end;
+}
+
+/* ---------- Trigram index ---------- */
+
+/* Posting lists of basename trigrams, stored in the binary index.  A
+   segment of 3+ bytes can only occur in a basename containing each of its
+   trigrams, so find_matches() intersects those lists (shortest first) and
+   runs strstr() on the survivors only.  Postings are index entry numbers
+   in ascending order, so matches come out in the same order as a full
+   scan.  Entries added since the index was written (the journal tail and
+   remember_dir()) are a small delta that is scanned directly and folded
+   into the lists at the next compaction. */
+
+static uint32_t trigram_key(const char *p)
+{
+    return (uint32_t)(unsigned char)p[0] << 16 |
+           (uint32_t)(unsigned char)p[1] << 8 |
+           (uint32_t)(unsigned char)p[2];
+}
+
+// Posting lists for the live entries of dirs[], numbered as save_index()
+// writes them.  Both arrays are malloc'd.
+static void build_trigrams(struct index_trigram **out_tris, uint32_t *out_ntris,
+                           uint32_t **out_posts, uint32_t *out_nposts)
+{
+    // (key << 32 | entry) pairs, generated in entry order
+    size_t n = 0, cap = 1024;
+    uint64_t *pairs = xrealloc(NULL, cap * sizeof(pairs[0]));
+    uint32_t j = 0;
+
+    for (int i = 0; i < dir_count; i++)
+    {
+        if (!entry_path(i))
+            continue;
+
+        const char *base = base_name(entry_path(i));
+        size_t blen = strlen(base);
+        size_t first = n;
+
+        for (size_t k = 0; k + 3 <= blen; k++)
+        {
+            uint64_t pair = (uint64_t)trigram_key(base + k) << 32 | j;
+
+            size_t d = first;
+            while (d < n && pairs[d] != pair)
+                d++;
+            if (d < n)
+                continue; // trigram repeats within this basename
+
+            if (n == cap)
+            {
+                cap *= 2;
+                pairs = xrealloc(pairs, cap * sizeof(pairs[0]));
+            }
+            pairs[n++] = pair;
+        }
+        j++;
+    }
+
+    // Stable LSD radix sort on the 24-bit key keeps entries ascending
+    // within each posting list.
+    uint64_t *tmp = xrealloc(NULL, (n ? n : 1) * sizeof(tmp[0]));
+    for (int shift = 32; shift < 56; shift += 8)
+    {
+        size_t count[257] = { 0 };
+        for (size_t k = 0; k < n; k++)
+            count[((pairs[k] >> shift) & 0xff) + 1]++;
+        for (int b = 0; b < 256; b++)
+            count[b + 1] += count[b];
+        for (size_t k = 0; k < n; k++)
+            tmp[count[(pairs[k] >> shift) & 0xff]++] = pairs[k];
+        uint64_t *t = pairs;
+        pairs = tmp;
+        tmp = t;
+    }
+    free(tmp);
+
+    struct index_trigram *tris = xrealloc(NULL, (n ? n : 1) * sizeof(tris[0]));
+    uint32_t *posts = xrealloc(NULL, (n ? n : 1) * sizeof(posts[0]));
+    uint32_t ntris = 0;
+
+    for (size_t k = 0; k < n; k++)
+    {
+        uint32_t key = (uint32_t)(pairs[k] >> 32);
+        if (ntris == 0 || tris[ntris - 1].key != key)
+        {
+            tris[ntris].key = key;
+            tris[ntris].start = (uint32_t)k;
+            ntris++;
+        }
+        posts[k] = (uint32_t)pairs[k];
+    }
+    free(pairs);
+
+    *out_tris = tris;
+    *out_ntris = ntris;
+    *out_posts = posts;
+    *out_nposts = (uint32_t)n;
+}
+
+// Posting list of one trigram in the mapped index; NULL if no basename
+// has it.
+static const uint32_t *trigram_postings(uint32_t key, uint32_t *len)
+{
+    uint32_t lo = 0, hi = index_tri_count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (index_trigrams[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == index_tri_count || index_trigrams[lo].key != key)
+        return NULL;
+
+    uint32_t start = index_trigrams[lo].start;
+    uint32_t end = (lo + 1 < index_tri_count) ? index_trigrams[lo + 1].start
+                                              : index_post_count;
+    if (start > end || end > index_post_count)
+        return NULL; // damaged index: treat as no match
+
+    *len = end - start;
+    return index_postings + start;
+}
+
+// At least as many indexed entries as have segment (3+ bytes) in their
+// basename: the length of its shortest trigram posting list.
+static uint32_t trigram_estimate(const char *segment)
+{
+    size_t ntri = strlen(segment) - 2;
+    uint32_t best = UINT32_MAX;
+
+    for (size_t k = 0; k < ntri; k++)
+    {
+        uint32_t len;
+        if (!trigram_postings(trigram_key(segment + k), &len))
+            return 0;
+        if (len < best)
+            best = len;
+    }
+    return best;
+}
+
+// Matches of a 3+ byte segment among dirs[0 .. index_count).
+static void trigram_matches(const char *segment, int **indices, int *count, int *cap)
+{
+    struct posting
+    {
+        const uint32_t *p;
+        uint32_t n;
+        uint32_t pos;
+    };
+
+    size_t ntri = strlen(segment) - 2;
+    struct posting *lists = xrealloc(NULL, ntri * sizeof(lists[0]));
+    size_t nlists = 0;
+
+    for (size_t k = 0; k < ntri; k++)
+    {
+        uint32_t len;
+        const uint32_t *p = trigram_postings(trigram_key(segment + k), &len);
+        if (!p)
+        {
+            free(lists);
+            return; // some trigram occurs in no basename at all
+        }
+
+        size_t d = 0;
+        while (d < nlists && lists[d].p != p)
+            d++;
+        if (d < nlists)
+            continue;
+
+        // insertion sort by length: intersect starting from the shortest
+        size_t at = nlists++;
+        while (at > 0 && lists[at - 1].n > len)
+        {
+            lists[at] = lists[at - 1];
+            at--;
+        }
+        lists[at].p = p;
+        lists[at].n = len;
+        lists[at].pos = 0;
+    }
+
+    for (uint32_t c = 0; c < lists[0].n; c++)
+    {
+        uint32_t e = lists[0].p[c];
+        int in_all = 1;
+
+        for (size_t k = 1; k < nlists && in_all; k++)
+        {
+            // lower bound of e in the rest of list k
+            struct posting *l = &lists[k];
+            uint32_t lo = l->pos, hi = l->n;
+            while (lo < hi)
+            {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (l->p[mid] < e)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            l->pos = lo;
+            in_all = lo < l->n && l->p[lo] == e;
+        }
+
+        if (in_all && (int)e < index_count && entry_live((int)e) &&
+            strstr(entry_base((int)e), segment))
+            push_match(indices, count, cap, (int)e);
+    }
+
+    free(lists);
+}
+
+/* ---------- Path trie ---------- */
+
+/* The index also stores the remembered paths as a trie of components,
+   each distinct component name kept once, with the nodes in depth-first
+   order and children sorted by name.  A directory's subtree is then the
+   run of nodes right after it, already in path order, so xcd -l /some/dir
+   walks one component per level down to the directory and reads the run
+   off; nothing is scanned.  Built by save_index() from the live entries,
+   along with a list of the nodes sorted by name for multi-segment queries.
+   Both are indexes for subtree lookups only, next to the full-path pool
+   that entry_path() reads, not a replacement for it: they make the index
+   bigger (9.6 of 25.8 MB at 100k paths), not smaller.  Without an index
+   file there is no trie, and xcd -l /some/dir filters every path. */
+
+// Order paths component by component: '/' sorts before any other byte, so
+// "/a/b" is followed by its subtree before "/a/b-c" comes.
+static int path_order(const void *a, const void *b)
+{
+    const unsigned char *p = (const unsigned char *)entry_path(*(const int *)a);
+    const unsigned char *q = (const unsigned char *)entry_path(*(const int *)b);
+
+    while (*p && *p == *q)
+    {
+        p++;
+        q++;
+    }
+    int x = (*p == '/') ? 1 : *p;
+    int y = (*q == '/') ? 1 : *q;
+    return x - y;
+}
+
+struct name_table
+{
+    char *buf;          // the names, NUL-terminated
+    size_t len, cap;
+    uint32_t *slots;    // offset + 1 of a name, 0 when empty
+    size_t slot_cap, used;
+};
+
+static uint32_t intern_name(struct name_table *t, const char *s, size_t n)
+{
+    if ((t->used + 1) * 2 > t->slot_cap)
+    {
+        size_t cap = t->slot_cap ? t->slot_cap * 2 : 1024;
+        uint32_t *slots = calloc(cap, sizeof(slots[0]));
+        if (!slots)
+        {
+            fprintf(stderr, "xcd-core: out of memory\n");
+            fatal_exit();
+        }
+        for (size_t k = 0; k < t->slot_cap; k++)
+        {
+            if (!t->slots[k])
+                continue;
+            const char *name = t->buf + t->slots[k] - 1;
+            size_t slot = hash_bytes(name, strlen(name)) & (cap - 1);
+            while (slots[slot])
+                slot = (slot + 1) & (cap - 1);
+            slots[slot] = t->slots[k];
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->slot_cap = cap;
+    }
+
+    size_t slot = hash_bytes(s, n) & (t->slot_cap - 1);
+    for (; t->slots[slot]; slot = (slot + 1) & (t->slot_cap - 1))
+    {
+        const char *name = t->buf + t->slots[slot] - 1;
+        if (strncmp(name, s, n) == 0 && name[n] == '\0')
+            return t->slots[slot] - 1;
+    }
+
+    if (t->len + n + 1 > t->cap)
+    {
+        t->cap = t->cap ? t->cap * 2 : 1 << 16;
+        while (t->len + n + 1 > t->cap)
+            t->cap *= 2;
+        t->buf = xrealloc(t->buf, t->cap);
+    }
+    uint32_t off = (uint32_t)t->len;
+    memcpy(t->buf + off, s, n);
+    t->buf[off + n] = '\0';
+    t->len += n + 1;
+    t->slots[slot] = off + 1;
+    t->used++;
+    return off;
+}
+
+// Trie of the live entries of dirs[], numbered as save_index() writes
+// them.  Both arrays are malloc'd; the names end in BASE_PAD zeros, for
+// the substring kernels.  Returns whether every entry is in it, which a
+// path that is not absolute is not.
+static int build_trie(struct trie_node **out_nodes, uint32_t *out_count,
+                      char **out_names, uint32_t *out_size)
+{
+    int *order = xrealloc(NULL, (size_t)(dir_count ? dir_count : 1) * sizeof(order[0]));
+    int *number = xrealloc(NULL, (size_t)(dir_count ? dir_count : 1) * sizeof(number[0]));
+    int n = 0, j = 0;
+
+    for (int i = 0; i < dir_count; i++)
+    {
+        if (!entry_path(i))
+            continue;
+        number[i] = j++;
+        if (entry_path(i)[0] == '/')
+            order[n++] = i;
+    }
+    qsort(order, (size_t)n, sizeof(order[0]), path_order);
+
+    struct name_table names;
+    memset(&names, 0, sizeof(names));
+
+    size_t cap = 1024, count = 0;
+    struct trie_node *nodes = xrealloc(NULL, cap * sizeof(nodes[0]));
+    int depth_cap = 64, depth = 0;  // stack[0 .. depth] is the current path
+    uint32_t *stack = xrealloc(NULL, (size_t)depth_cap * sizeof(stack[0]));
+
+    nodes[count].name = intern_name(&names, "", 0);
+    nodes[count].entry = -1;
+    stack[0] = (uint32_t)count++;
+
+    for (int k = 0; k < n; k++)
+    {
+        const char *p = entry_path(order[k]) + 1;
+        int d = 0;
+
+        while (*p)
+        {
+            const char *end = strchr(p, '/');
+            size_t len = end ? (size_t)(end - p) : strlen(p);
+            const char *next = end ? end + 1 : p + len;
+            if (len == 0)
+            {
+                p = next;
+                continue;
+            }
+
+            // Shared with the previous path: step down into it.
+            if (d < depth)
+            {
+                const char *name = names.buf + nodes[stack[d + 1]].name;
+                if (strncmp(name, p, len) == 0 && name[len] == '\0')
+                {
+                    d++;
+                    p = next;
+                    continue;
+                }
+            }
+
+            // Close what the previous path had below here, then open.
+            for (; depth > d; depth--)
+                nodes[stack[depth]].size = (uint32_t)(count - stack[depth]);
+
+            if (count == cap)
+            {
+                cap *= 2;
+                nodes = xrealloc(nodes, cap * sizeof(nodes[0]));
+            }
+            if (depth + 1 == depth_cap)
+            {
+                depth_cap *= 2;
+                stack = xrealloc(stack, (size_t)depth_cap * sizeof(stack[0]));
+            }
+            nodes[count].name = intern_name(&names, p, len);
+            nodes[count].entry = -1;
+            stack[++depth] = (uint32_t)count++;
+            d = depth;
+            p = next;
+        }
+
+        for (; depth > d; depth--)
+            nodes[stack[depth]].size = (uint32_t)(count - stack[depth]);
+        nodes[stack[d]].entry = number[order[k]];
+    }
+    for (; depth >= 0; depth--)
+        nodes[stack[depth]].size = (uint32_t)(count - stack[depth]);
+
+    free(stack);
+    free(order);
+    free(number);
+    free(names.slots);
+
+    names.buf = xrealloc(names.buf, names.len + BASE_PAD);
+    memset(names.buf + names.len, 0, BASE_PAD);
+
+    *out_nodes = nodes;
+    *out_count = (uint32_t)count;
+    *out_names = names.buf;
+    *out_size = (uint32_t)names.len + BASE_PAD;
+    return n == j;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// The trie's nodes by name (name offset, then node number): the nodes of
+// one name are a binary search away.  Malloc'd.
+static struct name_node *build_name_nodes(const struct trie_node *nodes,
+                                          uint32_t count)
+{
+    uint64_t *pairs = xrealloc(NULL, (count ? count : 1) * sizeof(pairs[0]));
+    for (uint32_t k = 0; k < count; k++)
+        pairs[k] = (uint64_t)nodes[k].name << 32 | k;
+    qsort(pairs, count, sizeof(pairs[0]), cmp_u64);
+
+    struct name_node *out = xrealloc(NULL, (count ? count : 1) * sizeof(out[0]));
+    for (uint32_t k = 0; k < count; k++)
+    {
+        out[k].node = (uint32_t)pairs[k];
+        out[k].size = nodes[out[k].node].size;
+    }
+    free(pairs);
+    return out;
+}
+
+// Node of directory path (absolute, canonical) in the mapped trie, or -1.
+// The file is not trusted: every link is bounds-checked on the way.
+static int64_t trie_find(const char *path)
+{
+    if (!index_nodes || index_node_count == 0 || path[0] != '/')
+        return -1;
+
+    uint32_t node = 0;
+    const char *p = path + 1;
+
+    while (*p)
+    {
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len > 0)
+        {
+            uint32_t stop = node + index_nodes[node].size;
+            if (stop > index_node_count || stop <= node)
+                return -1;
+
+            // Children are sorted by name: stop at the first one that
+            // is not below the component.
+            uint32_t c = node + 1;
+            while (c < stop)
+            {
+                uint32_t name = index_nodes[c].name;
+                if (name >= index_name_size)
+                    return -1;
+                int cmp = strncmp(index_names + name, p, len);
+                if (cmp == 0 && index_names[name + len] == '\0')
+                    break;
+                if (cmp >= 0 || index_nodes[c].size == 0)
+                    return -1;
+                c += index_nodes[c].size;
+            }
+            if (c >= stop)
+                return -1;
+            node = c;
+        }
+        p = end ? end + 1 : p + len;
+    }
+    return node;
+}
+
+// First of the name postings whose node's name is at or after offset name.
+static uint32_t name_nodes_from(uint32_t name)
+{
+    uint32_t lo = 0, hi = index_name_node_count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint32_t x = index_name_nodes[mid].node;
+        if (x < index_node_count && index_nodes[x].name < name)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Indexed entries below a directory whose name contains seg (not that
+// directory itself: seg is to match an ancestor), in entry order, into a
+// malloc'd *out.  The trie's names are swept once, each distinct name
+// once, and the nodes of every name that matches lead to their subtrees;
+// no entry is looked at that is not in one.  Returns how many, or -1 if
+// the subtrees hold more than `limit` nodes or the index cannot say.
+static int subtree_candidates(const char *seg, long limit, int **out)
+{
+    size_t seg_len = strlen(seg);
+    if (!index_name_nodes || seg_len == 0)
+        return -1;
+    if (!find_kernel)
+        find_kernel = pick_kernel();
+
+    size_t cap = 64, nruns = 0;
+    uint64_t *runs = xrealloc(NULL, cap * sizeof(runs[0])); // start << 32 | stop
+    long total = 0;
+    size_t pos = 0;
+
+    while ((pos = find_kernel(index_names, index_name_size, seg, seg_len, pos)) <
+           index_name_size)
+    {
+        uint32_t name = (uint32_t)pos;
+        while (name > 0 && index_names[name - 1] != '\0')
+            name--;
+
+        uint32_t lo = name_nodes_from(name), end = name_nodes_from(name + 1);
+        for (; lo < end; lo++)
+        {
+            uint32_t x = index_name_nodes[lo].node;
+            uint32_t size = index_name_nodes[lo].size;
+            if (size < 2 || size > index_node_count - x)
+                continue; // a leaf, or damaged
+            total += size - 1;
+            if (total > limit)
+            {
+                free(runs);
+                return -1;
+            }
+            if (nruns == cap)
+            {
+                cap *= 2;
+                runs = xrealloc(runs, cap * sizeof(runs[0]));
+            }
+            runs[nruns++] = (uint64_t)(x + 1) << 32 | (x + size);
+        }
+
+        pos = name + strlen(index_names + name) + 1; // on to the next name
+    }
+
+    // Subtrees nest: by start, one inside the last one taken is skipped.
+    qsort(runs, nruns, sizeof(runs[0]), cmp_u64);
+    int n = 0, ncap = 64;
+    int *indices = xrealloc(NULL, (size_t)ncap * sizeof(indices[0]));
+    uint32_t covered = 0;
+    for (size_t r = 0; r < nruns; r++)
+    {
+        uint32_t start = (uint32_t)(runs[r] >> 32), stop = (uint32_t)runs[r];
+        if (start < covered)
+            continue;
+        for (uint32_t k = start; k < stop; k++)
+        {
+            int32_t e = index_nodes[k].entry;
+            if (e >= 0 && e < index_count)
+                push_match(&indices, &n, &ncap, e);
+        }
+        covered = stop;
+    }
+    free(runs);
+
+    // path order to entry order
+    qsort(indices, (size_t)n, sizeof(indices[0]), cmp_int);
+    int kept = 0;
+    for (int i = 0; i < n; i++)
+        if (kept == 0 || indices[i] != indices[kept - 1])
+            indices[kept++] = indices[i];
+
+    *out = indices;
+    return kept;
+}
+
+/* ---------- Binary index ---------- */
+
+// Hash of the last bytes of the first `size` bytes of the text file, used
+// to check that the prefix an index was built from is still there.
+static int memory_tail_hash(int fd, uint64_t size, uint32_t *out)
+{
+    char buf[INDEX_TAIL_BYTES];
+    size_t n = size < sizeof(buf) ? (size_t)size : sizeof(buf);
+    if (pread(fd, buf, n, (off_t)(size - n)) != (ssize_t)n)
+        return 0;
+    *out = hash_bytes(buf, n);
+    return 1;
+}
+
+// Records the text file may hold past what the index covers before the
+// index is rebuilt.  It grows with the index, so a large store is not
+// rebuilt every few hundred visits.
+static int index_tail_max()
+{
+    int n = index_count >> INDEX_TAIL_SHIFT;
+    return n > INDEX_TAIL_MIN ? n : INDEX_TAIL_MIN;
+}
+
+// Map the index and take its entries as they are.  `fd`/`tst` describe
+// the open text file.  Only the header is checked here: the offsets into
+// the pool and basename columns are checked as entries are read, so this
+// does the same work for ten entries as for a million.  Returns the number
+// of bytes of the text file the index covers, or -1 if the index is
+// missing or stale.
+static off_t load_index(int fd, const struct stat *tst)
+{
+    // Read-write if we may, for the inodes; an index we cannot write to
+    // is used read-only.
+    trace.opens++;
+    int ifd = open(index_file, O_RDWR);
+    index_writable = ifd >= 0;
+    if (ifd < 0)
+        ifd = open(index_file, O_RDONLY);
+    if (ifd < 0)
+        return -1;
+
+    index_enabled = 1;
+
+    struct stat ist;
+    if (fstat(ifd, &ist) != 0 ||
+        (size_t)ist.st_size < sizeof(struct index_header))
+    {
+        close(ifd);
+        index_dirty = 1;
+        return -1;
+    }
+
+    void *map = mmap(NULL, (size_t)ist.st_size,
+                     PROT_READ | (index_writable ? PROT_WRITE : 0), MAP_SHARED, ifd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(ifd);
+        index_dirty = 1;
+        return -1;
+    }
+
+    const struct index_header *h = map;
+    size_t len = (size_t)ist.st_size;
+    size_t table = (size_t)h->count * sizeof(uint32_t);
+    size_t inodes = (size_t)h->count * sizeof(struct dir_inode);
+    size_t starts = table + sizeof(uint32_t);
+    size_t slots = (size_t)h->slot_count * sizeof(struct dir_slot);
+    size_t tris = (size_t)h->tri_count * sizeof(struct index_trigram);
+    size_t posts = (size_t)h->post_count * sizeof(uint32_t);
+    size_t nodes = (size_t)h->node_count * sizeof(struct trie_node);
+    size_t name_nodes = (size_t)h->name_node_count * sizeof(struct name_node);
+    size_t stamps = (size_t)h->peer_count * sizeof(struct shard_stamp);
+    size_t peer_table = h->peer_count ? table : 0;
+    size_t peer_flags = h->peer_count ? h->count : 0;
+    uint32_t tail = 0;
+
+    if (memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != INDEX_VERSION ||
+        h->count > len / sizeof(uint32_t) ||
+        h->slot_count == 0 ||
+        h->slot_count > len / sizeof(struct dir_slot) ||
+        h->slot_count / 2 < h->count ||
+        (h->slot_count & (h->slot_count - 1)) != 0 ||
+        h->tri_count > len / sizeof(struct index_trigram) ||
+        h->post_count > len / sizeof(uint32_t) ||
+        h->node_count > len / sizeof(struct trie_node) ||
+        (h->name_node_count != 0 && h->name_node_count != h->node_count) ||
+        h->name_size > len ||
+        h->name_size < BASE_PAD ||
+        h->peer_count > len / sizeof(struct shard_stamp) ||
+        h->own_count > h->count ||
+        h->pool_size > len ||
+        h->base_size > len ||
+        h->base_size < BASE_PAD ||
+        sizeof(*h) + stamps + inodes + 3 * table + 2 * peer_table + starts +
+            2 * slots + tris + posts + nodes + name_nodes + h->name_size + peer_flags +
+            h->base_size + h->pool_size != len ||
+        (h->pool_size > 0 && ((const char *)map)[len - 1] != '\0') ||
+        h->src_dev != (uint64_t)tst->st_dev ||
+        h->src_ino != (uint64_t)tst->st_ino ||
+        h->src_size > (uint64_t)tst->st_size ||
+        !memory_tail_hash(fd, h->src_size, &tail) ||
+        h->src_tail != tail)
+    {
+        munmap(map, len);
+        close(ifd);
+        index_dirty = 1;
+        return -1;
+    }
+
+    char *sect = (char *)(h + 1);
+    const struct shard_stamp *stamp_col = (const struct shard_stamp *)sect;
+    sect += stamps;
+    index_inodes = (struct dir_inode *)sect;
+    sect += inodes;
+    const uint32_t *offsets = (const uint32_t *)sect;
+    const uint32_t *visits = (const uint32_t *)(sect + table);
+    const uint32_t *last = (const uint32_t *)(sect + 2 * table);
+    sect += 3 * table;
+    const uint32_t *peer_visits = (const uint32_t *)sect;
+    const uint32_t *peer_last = (const uint32_t *)(sect + peer_table);
+    sect += 2 * peer_table;
+    const uint32_t *base_start_col = (const uint32_t *)sect;
+    sect += starts;
+    index_slots = (const struct dir_slot *)sect;
+    sect += slots;
+    index_inode_slots = (struct dir_slot *)sect;
+    sect += slots;
+    index_trigrams = (const struct index_trigram *)sect;
+    sect += tris;
+    index_postings = (const uint32_t *)sect;
+    sect += posts;
+    index_nodes = (const struct trie_node *)sect;
+    sect += nodes;
+    index_name_nodes = h->name_node_count ? (const struct name_node *)sect : NULL;
+    sect += name_nodes;
+    index_names = sect;
+    sect += h->name_size;
+    const unsigned char *peer_col = (const unsigned char *)sect;
+    sect += peer_flags;
+    index_bases = sect;
+    index_base_start = base_start_col;
+    sect += h->base_size;
+    char *pool = sect;
+
+    int bad = base_start_col[h->count] > h->base_size - BASE_PAD ||
+              index_names[h->name_size - BASE_PAD] != '\0' ||
+              index_names[h->name_size - 1] != '\0';
+    for (uint32_t k = 0; k < h->peer_count && !bad; k++)
+        bad = memchr(stamp_col[k].name, '\0', SHARD_NAME_MAX) == NULL;
+    if (bad)
+    {
+        munmap(map, len);
+        close(ifd);
+        index_slots = NULL;
+        index_inodes = NULL;
+        index_inode_slots = NULL;
+        index_trigrams = NULL;
+        index_postings = NULL;
+        index_nodes = NULL;
+        index_name_nodes = NULL;
+        index_names = NULL;
+        index_bases = NULL;
+        index_base_start = NULL;
+        index_dirty = 1;
+        return -1;
+    }
+
+    index_map = map;
+    index_map_len = len;
+    index_slot_count = h->slot_count;
+    index_tri_count = h->tri_count;
+    index_post_count = h->post_count;
+    index_node_count = h->node_count;
+    index_name_node_count = h->name_node_count;
+    index_name_size = h->name_size - BASE_PAD;
+    index_offsets = offsets;
+    index_pool = pool;
+    index_pool_size = h->pool_size;
+
+    // Room for what the text file adds on top; the columns map the rest.
+    const char *m = map;
+    size_t count = h->count, cap = count + 1024;
+    size_t peer_rows = h->peer_count ? count : 0;
+    dir_count = 0;
+    dir_cap = (int)cap;
+    dirs = xrealloc(dirs, cap * sizeof(dirs[0]));
+    dir_inodes = xrealloc(dir_inodes, cap * sizeof(dir_inodes[0]));
+    dir_visits = column_map(dir_visits, &visits_map, ifd,
+                            (size_t)((const char *)visits - m),
+                            sizeof(dir_visits[0]), count, cap);
+    dir_last = column_map(dir_last, &last_map, ifd,
+                          (size_t)((const char *)last - m),
+                          sizeof(dir_last[0]), count, cap);
+    dir_peer_visits = column_map(dir_peer_visits, &peer_visits_map, ifd,
+                                 (size_t)((const char *)peer_visits - m),
+                                 sizeof(dir_peer_visits[0]), peer_rows, cap);
+    dir_peer_last = column_map(dir_peer_last, &peer_last_map, ifd,
+                               (size_t)((const char *)peer_last - m),
+                               sizeof(dir_peer_last[0]), peer_rows, cap);
+    dir_peer = column_map(dir_peer, &peer_map, ifd,
+                          (size_t)((const char *)peer_col - m),
+                          sizeof(dir_peer[0]), peer_rows, cap);
+    close(ifd);
+
+    // Zeroed pages come from the kernel as they are first touched.
+    free(index_dropped);
+    index_dropped = calloc(count ? count : 1, 1);
+    if (!index_dropped)
+    {
+        fprintf(stderr, "xcd-core: out of memory\n");
+        fatal_exit();
+    }
+
+    free(peers);
+    peers = xrealloc(NULL, (stamps ? stamps : 1));
+    memcpy(peers, stamp_col, stamps);
+    peer_count = (int)h->peer_count;
+
+    dir_count = (int)count;
+    index_count = dir_count;
+    own_count = (int)h->own_count;
+    trace.loaded += h->count;
+
+    return (off_t)h->src_size;
+}
+
+// Write the index for the current dirs[], covering the first
+// memory_loaded_size bytes of the text file.  The new file is renamed
+// into place so processes that have the old one mapped keep a valid view.
+static void save_index()
+{
+    trace.opens++;
+    int fd = open(memory_file, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat tst;
+    uint32_t tail = 0;
+    int ok = fstat(fd, &tst) == 0 &&
+             tst.st_dev == memory_dev && tst.st_ino == memory_ino &&
+             memory_tail_hash(fd, (uint64_t)memory_loaded_size, &tail);
+    close(fd);
+    if (!ok)
+        return; // replaced under us; the next load rebuilds the index
+
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%ld", index_file, (long)getpid());
+    tmp[sizeof(tmp) - 1] = '\0';
+
+    trace.opens++;
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "xcd-core: cannot write %s: %s\n",
+                tmp, strerror(errno));
+        return;
+    }
+
+    struct index_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.version = INDEX_VERSION;
+    h.src_dev = (uint64_t)memory_dev;
+    h.src_ino = (uint64_t)memory_ino;
+    h.src_size = (uint64_t)memory_loaded_size;
+    h.src_tail = tail;
+    h.peer_count = (uint32_t)peer_count;
+
+    uint64_t off = 0;
+    h.base_size = BASE_PAD;
+    for (int i = 0; i < dir_count; i++)
+    {
+        const char *path = entry_path(i);
+        if (!path)
+            continue;
+        h.count++;
+        if (!h.peer_count || !dir_peer[i])
+            h.own_count++;
+        off += strlen(path) + 1;
+        h.base_size += strlen(base_name(path)) + 1;
+    }
+    h.pool_size = off;
+
+    struct index_trigram *tris;
+    uint32_t *posts;
+    build_trigrams(&tris, &h.tri_count, &posts, &h.post_count);
+
+    struct trie_node *nodes;
+    char *names;
+    struct name_node *name_nodes = NULL;
+    if (build_trie(&nodes, &h.node_count, &names, &h.name_size))
+    {
+        name_nodes = build_name_nodes(nodes, h.node_count);
+        h.name_node_count = h.node_count;
+    }
+
+    h.slot_count = 1024;
+    while (h.slot_count < 2 * h.count)
+        h.slot_count *= 2;
+    struct dir_slot *slots = xrealloc(NULL, 2 * h.slot_count * sizeof(slots[0]));
+    struct dir_slot *inode_slots = slots + h.slot_count;
+    memset(slots, 0xff, 2 * h.slot_count * sizeof(slots[0]));
+
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(peers, sizeof(peers[0]), h.peer_count, f);
+
+    int j = 0;
+    for (int i = 0; i < dir_count; i++)
+    {
+        if (!entry_path(i))
+            continue;
+        const struct dir_inode *e = entry_inode(i);
+        fwrite(e, sizeof(*e), 1, f);
+        if (e->ino)
+            slot_place(inode_slots, h.slot_count, hash_inode(e->dev, e->ino), j);
+        j++;
+    }
+
+    off = 0;
+    j = 0;
+    for (int i = 0; i < dir_count; i++)
+    {
+        const char *path = entry_path(i);
+        if (!path)
+            continue;
+        uint32_t o = (uint32_t)off;
+        fwrite(&o, sizeof(o), 1, f);
+        off += strlen(path) + 1;
+        slot_place(slots, h.slot_count, hash_path(path), j++);
+    }
+
+    for (int i = 0; i < dir_count; i++)
+        if (entry_live(i))
+            fwrite(&dir_visits[i], sizeof(dir_visits[i]), 1, f);
+    for (int i = 0; i < dir_count; i++)
+        if (entry_live(i))
+            fwrite(&dir_last[i], sizeof(dir_last[i]), 1, f);
+    if (h.peer_count)
+    {
+        for (int i = 0; i < dir_count; i++)
+            if (entry_live(i))
+                fwrite(&dir_peer_visits[i], sizeof(dir_peer_visits[i]), 1, f);
+        for (int i = 0; i < dir_count; i++)
+            if (entry_live(i))
+                fwrite(&dir_peer_last[i], sizeof(dir_peer_last[i]), 1, f);
+    }
+
+    uint32_t bo = 0;
+    for (int i = 0; i < dir_count; i++)
+    {
+        const char *path = entry_path(i);
+        if (!path)
+            continue;
+        fwrite(&bo, sizeof(bo), 1, f);
+        bo += (uint32_t)strlen(base_name(path)) + 1;
+    }
+    fwrite(&bo, sizeof(bo), 1, f);
+
+    fwrite(slots, sizeof(slots[0]), 2 * h.slot_count, f);
+    free(slots);
+
+    fwrite(tris, sizeof(tris[0]), h.tri_count, f);
+    fwrite(posts, sizeof(posts[0]), h.post_count, f);
+    free(tris);
+    free(posts);
+
+    fwrite(nodes, sizeof(nodes[0]), h.node_count, f);
+    fwrite(name_nodes, sizeof(name_nodes[0]), h.name_node_count, f);
+    fwrite(names, 1, h.name_size, f);
+    free(nodes);
+    free(name_nodes);
+    free(names);
+
+    if (h.peer_count)
+        for (int i = 0; i < dir_count; i++)
+            if (entry_live(i))
+                fwrite(&dir_peer[i], sizeof(dir_peer[i]), 1, f);
+
+    static const char pad[BASE_PAD];
+    for (int i = 0; i < dir_count; i++)
+    {
+        const char *path = entry_path(i);
+        if (path)
+            fwrite(base_name(path), strlen(base_name(path)) + 1, 1, f);
+    }
+    fwrite(pad, 1, BASE_PAD, f);
+
+    for (int i = 0; i < dir_count; i++)
+    {
+        const char *path = entry_path(i);
+        if (path)
+            fwrite(path, strlen(path) + 1, 1, f);
+    }
+
+    trace.written += (unsigned long long)ftello(f);
+
+    if (fclose(f) != 0 || rename(tmp, index_file) != 0)
+    {
+        fprintf(stderr, "xcd-core: cannot write %s: %s\n",
+                index_file, strerror(errno));
+        unlink(tmp);
+        return;
+    }
+
+    index_enabled = 1;
+    index_dirty = 0;
+}
+
+// Bring a stale index up to date.  Someone is waiting on a one-shot run or
+// the builtin, so the rebuild goes to a detached grandchild that writes from
+// its copy of dirs[] after we are gone; save_index() renames the result
+// into place only if the text file is still the one it covers.  The server
+// answers before it flushes and builds inline.
+static void rebuild_index()
+{
+    if (index_inline)
+    {
+        save_index();
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        save_index();
+        return;
+    }
+    if (pid == 0)
+    {
+        // Off our stdout, or a $(xcd-core ...) would wait for the rebuild.
+        int null = open("/dev/null", O_RDWR);
+        if (null >= 0)
+        {
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        setsid();
+        if (fork() == 0)
+            save_index();
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    index_dirty = 0;
+}
+
+/* ---------- Load / Save memory ---------- */
+
+/* ~/.xcd_memory is an append-only journal of one path per line.  A save
+   appends only the entries added since load with a single O_APPEND
+   write(), so concurrent shells never overwrite each other.  Duplicate
+   and dead records are squeezed out by compact_memory(), which rewrites
+   the file under an exclusive lock and rename()s it into place, so a
+   crash can never leave a truncated memory file behind. */
+
+/* A record is a path, optionally followed by a tab, a visit count, a tab
+   and the time of the last visit.  Counts add up across records for the
+   same path, so a visit is journaled as "path\t1\tTIME" and compaction
+   writes one record per path with the totals. */
+
+// Split "path\tVISITS\tLAST" in place; a line without a numeric tail is
+// all path.
+static void parse_record(char *line, uint32_t *visits, uint32_t *last)
+{
+    *visits = 0;
+    *last = 0;
+
+    char *t2 = strrchr(line, '\t');
+    if (!t2 || t2 == line)
+        return;
+    *t2 = '\0';
+    char *t1 = strrchr(line, '\t');
+    *t2 = '\t';
+    if (!t1)
+        return;
+
+    char *end1, *end2;
+    unsigned long v = strtoul(t1 + 1, &end1, 10);
+    unsigned long l = strtoul(t2 + 1, &end2, 10);
+    if (end1 != t2 || end1 == t1 + 1 || *end2 != '\0' || end2 == t2 + 1)
+        return;
+
+    *t1 = '\0';
+    *visits = (uint32_t)v;
+    *last = (uint32_t)l;
+}
+
+// Read records from the current position of f, into the peer columns
+// with `peer`.  A final line without a newline may be an append still in
+// flight; it is left for next time.  Returns the offset just past the
+// last complete record.
+static off_t parse_records(FILE *f, int *records, int peer)
+{
+    char line[PATH_MAX + 32];
+    off_t end = ftello(f);
+
+    while (fgets(line, sizeof(line), f))
+    {
+        char *nl = strchr(line, '\n');
+        if (!nl)
+            break;
+        *nl = '\0';
+        end = ftello(f);
+
+        if (line[0] == '\0')
+            continue;
+
+        (*records)++;
+        trace.loaded++;
+
+        uint32_t visits, last;
+        parse_record(line, &visits, &last);
+
+        // Lines were canonical when written; no stat/realpath here.
+        int i = find_dir(line);
+        if (i < 0)
+        {
+            i = append_dir(arena_strdup(line));
+            set_peer(i, (unsigned char)peer);
+        }
+
+        if (peer)
+        {
+            if (dir_peer[i])
+                dir_peer[i] = 1;
+            dir_peer_visits[i] += visits;
+            if (last > dir_peer_last[i])
+                dir_peer_last[i] = last;
+            continue;
+        }
+
+        set_peer(i, 0);
+        dir_visits[i] += visits;
+        if (last > dir_last[i])
+            dir_last[i] = last;
+    }
+
+    return end;
+}
+
+// This host's shard: its name, with '/' and a leading '.' made harmless.
+static void shard_host(char *buf, size_t size)
+{
+    if (gethostname(buf, size) != 0 || buf[0] == '\0')
+        snprintf(buf, size, "localhost");
+    buf[size - 1] = '\0';
+    for (char *p = buf; *p; p++)
+        if (*p == '/')
+            *p = '_';
+    if (buf[0] == '.')
+        buf[0] = '_';
+}
+
+static int cmp_stamp(const void *a, const void *b)
+{
+    return strcmp(((const struct shard_stamp *)a)->name,
+                  ((const struct shard_stamp *)b)->name);
+}
+
+// The peer shards as they are now, sorted by name, in a malloc'd array.
+// Dot files in the shard directory are indexes and files being written.
+static int list_peers(struct shard_stamp **out)
+{
+    int count = 0;
+    int cap = 16;
+    struct shard_stamp *list = xrealloc(NULL, (size_t)cap * sizeof(list[0]));
+
+    trace.opens++;
+    DIR *d = opendir(shard_dir);
+    if (d)
+    {
+        struct dirent *e;
+        while ((e = readdir(d)))
+        {
+            if (e->d_name[0] == '.' || strcmp(e->d_name, shard_name) == 0 ||
+                strlen(e->d_name) >= SHARD_NAME_MAX)
+                continue;
+
+            struct stat st;
+            trace.stats++;
+            if (fstatat(dirfd(d), e->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+                continue;
+
+            if (count == cap)
+            {
+                cap *= 2;
+                list = xrealloc(list, (size_t)cap * sizeof(list[0]));
+            }
+            memset(&list[count], 0, sizeof(list[count]));
+            list[count].dev = (uint64_t)st.st_dev;
+            list[count].ino = (uint64_t)st.st_ino;
+            list[count].size = (uint64_t)st.st_size;
+            snprintf(list[count].name, sizeof(list[count].name), "%s", e->d_name);
+            count++;
+        }
+        closedir(d);
+    }
+
+    qsort(list, (size_t)count, sizeof(list[0]), cmp_stamp);
+    *out = list;
+    return count;
+}
+
+// Bring the peer columns up to date with the shards in now[0 .. n), which
+// this takes over.  A shard that only grew is read from where the last
+// merge stopped; anything else (a shard compacted, added or gone) redoes
+// the merge from scratch.  The index is marked for rewriting when that
+// happened or the unmerged tails grow long.
+static void merge_peers(struct shard_stamp *now, int n)
+{
+    int full = (n != peer_count);
+    for (int k = 0; k < n && !full; k++)
+        full = strcmp(now[k].name, peers[k].name) != 0 ||
+               now[k].dev != peers[k].dev || now[k].ino != peers[k].ino ||
+               now[k].size < peers[k].size;
+
+    if (full)
+    {
+        // Entries still marked 2 afterwards are in no shard any more.
+        for (int i = 0; i < dir_count; i++)
+        {
+            dir_peer_visits[i] = 0;
+            dir_peer_last[i] = 0;
+            if (dir_peer[i])
+                dir_peer[i] = 2;
+        }
+    }
+
+    // Entries learned from peers are never journaled here.
+    int all_saved = saved_count == dir_count;
+    int records = 0;
+
+    for (int k = 0; k < n; k++)
+    {
+        uint64_t from = full ? 0 : peers[k].size;
+        if (from == now[k].size)
+            continue;
+
+        char path[PATH_MAX + SHARD_NAME_MAX];
+        snprintf(path, sizeof(path), "%s/%s", shard_dir, now[k].name);
+        trace.opens++;
+        FILE *f = fopen(path, "r");
+        struct stat st;
+        if (!f || fstat(fileno(f), &st) != 0 ||
+            (uint64_t)st.st_dev != now[k].dev || (uint64_t)st.st_ino != now[k].ino)
+        {
+            // Replaced since it was listed: merge it in full next time.
+            now[k].ino = 0;
+            now[k].size = 0;
+            if (f)
+                fclose(f);
+            continue;
+        }
+        fseeko(f, (off_t)from, SEEK_SET);
+        now[k].size = (uint64_t)parse_records(f, &records, 1);
+        fclose(f);
+    }
+
+    if (full)
+    {
+        for (int i = 0; i < dir_count; i++)
+        {
+            if (dir_peer[i] == 2)
+            {
+                clear_entry(i);
+                dir_peer[i] = 0;
+            }
+        }
+    }
+
+    if (all_saved)
+        saved_count = dir_count;
+
+    free(peers);
+    peers = now;
+    peer_count = n;
+
+    if (full || records > index_tail_max())
+        index_dirty = 1;
+}
+
+// Format entry i as a journal record; returns its length.
+static int format_record(char *buf, size_t size, int i, uint32_t visits, uint32_t last)
+{
+    if (visits == 0)
+        return snprintf(buf, size, "%s\n", entry_path(i));
+    return snprintf(buf, size, "%s\t%lu\t%lu\n", entry_path(i),
+                    (unsigned long)visits, (unsigned long)last);
+}
+
+// Entries this host's journal holds: kept count of by append_dir(),
+// drop_dir() and set_peer(), so no save has to walk every entry.
+static int live_count()
+{
+    return own_count;
+}
+
+static void load_memory()
+{
+    const char *home = get_home();
+    snprintf(shard_dir, sizeof(shard_dir), "%s/.xcd_memory.d", home);
+    shard_dir[sizeof(shard_dir) - 1] = '\0';
+
+    struct stat st;
+    trace.stats++;
+    shard_mode = stat(shard_dir, &st) == 0 && S_ISDIR(st.st_mode);
+
+    if (shard_mode)
+    {
+        shard_host(shard_name, sizeof(shard_name));
+        snprintf(memory_file, sizeof(memory_file), "%s/%s", shard_dir, shard_name);
+        snprintf(index_file, sizeof(index_file), "%s/.%s.idx", shard_dir, shard_name);
+
+        // The first host to start sharding takes over the old file, and
+        // its index: the inode it was built from is the same, so it stays
+        // valid, and ~/.xcd_memory.idx is not left behind stale.
+        char old[PATH_MAX];
+        snprintf(old, sizeof(old), "%s/.xcd_memory", home);
+        if (access(memory_file, F_OK) != 0 && rename(old, memory_file) == 0)
+        {
+            snprintf(old, sizeof(old), "%s/.xcd_memory.idx", home);
+            if (rename(old, index_file) != 0)
+                unlink(old);
+        }
+
+        // The index is the merged snapshot: always kept.
+        index_enabled = 1;
+    }
+    else
+    {
+        snprintf(memory_file, sizeof(memory_file), "%s/.xcd_memory", home);
+        snprintf(index_file, sizeof(index_file), "%s/.xcd_memory.idx", home);
+        index_enabled = access(index_file, F_OK) == 0;
+    }
+    memory_file[sizeof(memory_file) - 1] = '\0';
+    index_file[sizeof(index_file) - 1] = '\0';
+
+    trace.opens++;
+    FILE *f = fopen(memory_file, "r");
+    int records = 0;
+
+    if (f)
+    {
+        if (fstat(fileno(f), &st) == 0)
+        {
+            memory_dev = st.st_dev;
+            memory_ino = st.st_ino;
+
+            off_t covered = load_index(fileno(f), &st);
+            if (covered >= 0)
+            {
+                journal_records = live_count();
+                fseeko(f, covered, SEEK_SET);
+            }
+        }
+
+        memory_loaded_size = parse_records(f, &records, 0);
+        journal_records += records;
+        fclose(f);
+    }
+
+    if (shard_mode)
+    {
+        struct shard_stamp *now;
+        int n = list_peers(&now);
+        merge_peers(now, n);
+    }
+
+    saved_count = dir_count;
+    if (!f)
+        return; // no file yet, that's fine
+
+    // Too much redundancy in the journal: compact on the way out.
+    if (journal_records > 2 * live_count() + COMPACT_SLACK)
+    {
+        compact_needed = 1;
+        memory_dirty = 1;
+    }
+
+    // Too much of it past what the index covers: the journal is fine as it
+    // is, only the index needs to take in the tail.
+    if (index_map && records > index_tail_max())
+        index_dirty = 1;
+}
+
+// Open the memory file and flock() it.  If a compaction renamed a new file
+// into place while we waited for the lock, start over on the new one.
+static int open_memory_locked(int flags, int op)
+{
+    for (int tries = 0; tries < 8; tries++)
+    {
+        trace.opens++;
+        int fd = open(memory_file, flags | O_CREAT, 0666);
+        if (fd < 0)
+            return -1;
+
+        flock(fd, op); // best effort: not every NFS setup supports it
+
+        struct stat a, b;
+        trace.stats++;
+        if (fstat(fd, &a) == 0 && stat(memory_file, &b) == 0 &&
+            a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+            return fd;
+
+        close(fd);
+    }
+
+    return -1;
+}
+
+// Fold in records other processes wrote since we last read the journal.
+// Same file: only the tail is new.  A different file (someone compacted)
+// restates every count, so ours are reset and the visits we have not
+// written yet are applied again on top.
+static void merge_memory(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return;
+
+    int same = st.st_dev == memory_dev && st.st_ino == memory_ino;
+    if (same && st.st_size == memory_loaded_size)
+        return;
+
+    int rfd = dup(fd);
+    FILE *f = (rfd >= 0) ? fdopen(rfd, "r") : NULL;
+    if (!f)
+    {
+        if (rfd >= 0)
+            close(rfd);
+        return;
+    }
+
+    if (!same && dir_count > 0)
+    {
+        memset(dir_visits, 0, (size_t)dir_count * sizeof(dir_visits[0]));
+        memset(dir_last, 0, (size_t)dir_count * sizeof(dir_last[0]));
+    }
+
+    // Entries learned from the file are already on disk, but can only be
+    // marked so when none of ours are waiting in front of them.
+    int all_saved = saved_count == dir_count;
+
+    int records = 0;
+    fseeko(f, same ? memory_loaded_size : 0, SEEK_SET);
+    memory_loaded_size = parse_records(f, &records, 0);
+    fclose(f);
+
+    if (all_saved)
+        saved_count = dir_count;
+
+    if (same)
+    {
+        journal_records += records;
+        return;
+    }
+
+    for (int v = 0; v < visit_log_count; v++)
+    {
+        struct visit *e = &visit_log[v];
+        dir_visits[e->idx]++;
+        if (e->when > dir_last[e->idx])
+            dir_last[e->idx] = e->when;
+    }
+
+    memory_dev = st.st_dev;
+    memory_ino = st.st_ino;
+    journal_records = records;
+}
+
+// Write dirs[saved_count ..] and the pending visits to fd as one write().
+static int write_journal(int fd)
+{
+    size_t cap = 0;
+    for (int i = saved_count; i < dir_count; i++)
+        if (entry_path(i) && !dir_peer[i])
+            cap += strlen(entry_path(i)) + 1;
+    for (int v = 0; v < visit_log_count; v++)
+        if (entry_path(visit_log[v].idx))
+            cap += strlen(entry_path(visit_log[v].idx)) + 32;
+
+    if (cap == 0)
+        return 1;
+    cap++; // snprintf()'s terminator after the last record
+
+    char *buf = xrealloc(NULL, cap);
+    size_t len = 0;
+    int n = 0;
+
+    for (int i = saved_count; i < dir_count; i++)
+    {
+        if (!entry_path(i) || dir_peer[i])
+            continue;
+        len += (size_t)format_record(buf + len, cap - len, i, 0, 0);
+        n++;
+    }
+
+    for (int v = 0; v < visit_log_count; v++)
+    {
+        int i = visit_log[v].idx;
+        if (!entry_path(i))
+            continue;
+        len += (size_t)format_record(buf + len, cap - len, i, 1, visit_log[v].when);
+        n++;
+    }
+
+    int ok = write(fd, buf, len) == (ssize_t)len;
+    if (!ok)
+    {
+        fprintf(stderr, "xcd-core: cannot write %s: %s\n",
+                memory_file, strerror(errno));
+    }
+    else
+    {
+        trace.written += len;
+        saved_count = dir_count;
+        visit_log_count = 0;
+        journal_records += n;
+    }
+
+    free(buf);
+    return ok;
+}
+
+// Append what this run learned to the journal.  A shared lock is enough:
+// O_APPEND writes from concurrent shells never interleave.
+static void append_memory()
+{
+    if (saved_count == dir_count && visit_log_count == 0)
+        return;
+
+    int fd = open_memory_locked(O_WRONLY | O_APPEND, LOCK_SH);
+    if (fd < 0)
+    {
+        fprintf(stderr, "xcd-core: cannot write %s: %s\n",
+                memory_file, strerror(errno));
+        return;
+    }
+
+    write_journal(fd);
+    close(fd);
+}
+
+// Rewrite the journal with one record per live entry.  With `merge`, any
+// records other shells appended since we loaded are folded in first.
+static void compact_memory(int merge)
+{
+    int fd = open_memory_locked(O_RDONLY, LOCK_EX);
+    if (fd < 0)
+    {
+        fprintf(stderr, "xcd-core: cannot open %s: %s\n",
+                memory_file, strerror(errno));
+        return;
+    }
+
+    struct stat st;
+    if (merge)
+        merge_memory(fd);
+
+    // A shard's temporary is a dot file, so no one takes it for a peer.
+    char tmp[PATH_MAX + 32];
+    if (shard_mode)
+        snprintf(tmp, sizeof(tmp), "%s/.%s.%ld", shard_dir, shard_name,
+                 (long)getpid());
+    else
+        snprintf(tmp, sizeof(tmp), "%s.%ld", memory_file, (long)getpid());
+    tmp[sizeof(tmp) - 1] = '\0';
+
+    trace.opens++;
+    FILE *out = fopen(tmp, "w");
+    if (!out)
+    {
+        fprintf(stderr, "xcd-core: cannot write %s: %s\n",
+                tmp, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    char rec[PATH_MAX + 32];
+    for (int i = 0; i < dir_count; i++)
+    {
+        if (!entry_path(i) || dir_peer[i])
+            continue;
+        format_record(rec, sizeof(rec), i, dir_visits[i], dir_last[i]);
+        fputs(rec, out);
+    }
+
+    if (fflush(out) != 0 || fsync(fileno(out)) != 0 ||
+        fstat(fileno(out), &st) != 0)
+    {
+        fprintf(stderr, "xcd-core: cannot write %s: %s\n",
+                tmp, strerror(errno));
+        fclose(out);
+        unlink(tmp);
+        close(fd);
+        return;
+    }
+    fclose(out);
+    trace.written += (unsigned long long)st.st_size;
+
+    if (rename(tmp, memory_file) != 0)
+    {
+        fprintf(stderr, "xcd-core: cannot replace %s: %s\n",
+                memory_file, strerror(errno));
+        unlink(tmp);
+        close(fd);
+        return;
+    }
+
+    close(fd); // releases the lock on the old file
+
+    memory_dev = st.st_dev;
+    memory_ino = st.st_ino;
+    memory_loaded_size = st.st_size;
+    saved_count = dir_count;
+    visit_log_count = 0;
+    journal_records = live_count();
+    compact_needed = 0;
+    memory_dirty = 0;
+
+    // A fresh file for the index to cover; whoever saves rebuilds it.
+    if (index_enabled)
+        index_dirty = 1;
+}
+
+static void save_memory()
+{
+    if (!memory_dirty)
+        return;
+
+    if (compact_needed || journal_records > 2 * live_count() + COMPACT_SLACK)
+        compact_memory(1);
+    else
+        append_memory();
+
+    memory_dirty = 0;
+}
+
+// Save for a process that stays up (the server, the bash builtin): the
+// journal is merged and appended to under an exclusive lock, so what is
+// on disk afterwards is known to be ours and is not read back later.
+static void flush_memory()
+{
+    if (memory_dirty)
+    {
+        if (compact_needed || journal_records > 2 * live_count() + COMPACT_SLACK)
+        {
+            compact_memory(1);
+        }
+        else
+        {
+            int fd = open_memory_locked(O_RDWR | O_APPEND, LOCK_EX);
+            if (fd >= 0)
+            {
+                merge_memory(fd);
+
+                struct stat st;
+                int whole = fstat(fd, &st) == 0 && st.st_size == memory_loaded_size;
+                if (write_journal(fd) && whole && fstat(fd, &st) == 0)
+                    memory_loaded_size = st.st_size;
+                close(fd);
+            }
+            else
+            {
+                fprintf(stderr, "xcd-core: cannot write %s: %s\n",
+                        memory_file, strerror(errno));
+            }
+        }
+        memory_dirty = 0;
+    }
+
+    if (index_dirty)
+        rebuild_index();
+}
+
+// Pick up records other processes appended since we last looked.
+static void refresh_memory()
+{
+    if (shard_mode)
+    {
+        struct shard_stamp *now;
+        int n = list_peers(&now);
+        merge_peers(now, n);
+    }
+
+    struct stat st;
+    trace.stats++;
+    if (stat(memory_file, &st) != 0 ||
+        (st.st_dev == memory_dev && st.st_ino == memory_ino &&
+         st.st_size == memory_loaded_size))
+        return;
+
+    int fd = open_memory_locked(O_RDONLY, LOCK_SH);
+    if (fd < 0)
+        return;
+    merge_memory(fd);
+    close(fd);
+}
+
+// dirs[] index of the directory path names, or -1 if it is not a
+// directory or (unless add) not remembered.  A directory already known by
+// its inode costs no realpath().
+static int locate_dir(const char *path, int add)
+{
+    struct stat st;
+    if (!stat_dir(path, &st))
+        return -1;
+
+    int i = find_inode(&st);
+    if (i >= 0)
+        return i;
+
+    char canon[PATH_MAX];
+    if (!canonical_path(path, canon, sizeof(canon)))
+        return -1;
+
+    i = find_dir(canon);
+    if (i < 0)
+    {
+        if (!add)
+            return -1;
+        memory_dirty = 1;
+        i = append_dir(arena_strdup(canon));
+    }
+    set_inode(i, &st);
+    return i;
+}
+
+// Remember path and return its dirs[] index, or -1 if it is not a directory.
+static int remember_dir(const char *path)
+{
+    return locate_dir(path, 1);
+}
+
+static void record_visit(int i)
+{
+    if (i < 0)
+        return;
+
+    uint32_t now = (uint32_t)time(NULL);
+    dir_visits[i]++;
+    dir_last[i] = now;
+    set_peer(i, 0); // journaled here from now on
+
+    if (visit_log_count == visit_log_cap)
+    {
+        visit_log_cap = visit_log_cap ? visit_log_cap * 2 : 16;
+        visit_log = xrealloc(visit_log, (size_t)visit_log_cap * sizeof(visit_log[0]));
+    }
+    visit_log[visit_log_count].idx = i;
+    visit_log[visit_log_count].when = now;
+    visit_log_count++;
+    memory_dirty = 1;
+}
+
+/* ---------- Scoped queries ---------- */
+
+/* xcd -w SEG... matches only below the project the current directory is
+   in: the nearest ancestor holding a .git, .hg or .svn, or the current
+   directory itself outside any.  The indexed entries below a directory
+   are a contiguous run of the path trie, found by walking down to it, so
+   a scoped query looks at the subtree and nothing else; only the delta
+   since the last compaction (or every entry, without an index) is
+   filtered by prefix. */
+
+static const char *const root_markers[] = { ".git", ".hg", ".svn" };
+
+static const char *query_scope = NULL;  // set for the length of an xcd -w
+
+// Is path the directory prefix or below it?  prefix has no trailing '/',
+// except for the root itself.
+static int under_prefix(const char *path, const char *prefix, size_t len)
+{
+    if (strncmp(path, prefix, len) != 0)
+        return 0;
+    return path[len] == '\0' || path[len] == '/' || prefix[len - 1] == '/';
+}
+
+// Entries at or below prefix (canonical, absolute), in a malloc'd array
+// the caller frees.  Sets *in_order when they come in path order.
+static int subtree_entries(const char *prefix, int **out, int *in_order)
+{
+    size_t len = strlen(prefix);
+    int *indices = xrealloc(NULL, (size_t)(dir_count ? dir_count : 1) * sizeof(indices[0]));
+    int count = 0;
+    int first = 0;  // dirs[first ..] still to be checked
+
+    if (index_nodes)
+    {
+        int64_t node = trie_find(prefix);
+        if (node >= 0)
+        {
+            uint32_t stop = (uint32_t)node + index_nodes[node].size;
+            if (stop > index_node_count)
+                stop = index_node_count;
+            for (uint32_t k = (uint32_t)node; k < stop; k++)
+            {
+                int32_t e = index_nodes[k].entry;
+                if (e >= 0 && e < index_count && entry_path(e))
+                    indices[count++] = e;
+            }
+        }
+        first = index_count;
+    }
+
+    *in_order = (first > 0);
+    for (int i = first; i < dir_count; i++)
+    {
+        if (entry_path(i) && under_prefix(entry_path(i), prefix, len))
+        {
+            indices[count++] = i;
+            *in_order = 0;
+        }
+    }
+
+    *out = indices;
+    return count;
+}
+
+// The directory xcd -w searches below, into buf.
+static int project_root(char *buf, size_t buflen)
+{
+    char dir[PATH_MAX];
+    char probe[PATH_MAX + 8];
+    struct stat st;
+
+    if (!getcwd(buf, buflen))
+        return 0;
+    snprintf(dir, sizeof(dir), "%s", buf);
+
+    for (;;)
+    {
+        int root = (strcmp(dir, "/") == 0);
+        for (size_t m = 0; m < sizeof(root_markers) / sizeof(root_markers[0]); m++)
+        {
+            snprintf(probe, sizeof(probe), "%s/%s", root ? "" : dir, root_markers[m]);
+            trace.stats++;
+            if (lstat(probe, &st) == 0)
+            {
+                snprintf(buf, buflen, "%s", dir);
+                return 1;
+            }
+        }
+        if (root)
+            return 1;  // no project: the current directory
+
+        char *slash = strrchr(dir, '/');
+        if (slash == dir)
+            slash++;
+        *slash = '\0';
+    }
+}
+
+// Entries below query_scope whose basename contains segment, or failing
+// that (*fuzzy set) matches it approximately; in entry order, like
+// find_matches().
+static int scope_matches(const char *segment, int **out_indices, int *fuzzy)
+{
+    int prev = trace_phase(PHASE_MATCH);
+    int in_order;
+    int *indices;
+    int count = subtree_entries(query_scope, &indices, &in_order);
+
+    qsort(indices, (size_t)count, sizeof(indices[0]), cmp_int);
+
+    int kept = 0;
+    for (int i = 0; i < count; i++)
+        if (strstr(entry_base(indices[i]), segment))
+            indices[kept++] = indices[i];
+
+    *fuzzy = (kept == 0 && segment[0] != '\0');
+    if (*fuzzy && strlen(segment) <= FUZZY_MAX)
+    {
+        struct fuzzy f;
+        fuzzy_init(&f, segment);
+        for (int i = 0; i < count; i++)
+        {
+            const char *base = entry_base(indices[i]);
+            if (fuzzy_match(&f, base, (int)strlen(base)))
+                indices[kept++] = indices[i];
+        }
+    }
+
+    trace_phase(prev);
+    *out_indices = indices;
+    return kept;
+}
+
+/* ---------- Commands ---------- */
+
+static void cmd_help()
+{
+    printf(
+        "xcd-core - core logic for xcd (Linux/macOS)\n\n"
+        "Usage (called via shell wrapper):\n"
+        "  xcd                 Print canonical HOME directory.\n"
+        "  xcd DIR             Print canonical DIR if it exists.\n"
+        "  xcd SEGMENT         Fuzzy match remembered dirs by basename and\n"
+        "                           print the most visited one; repeat to\n"
+        "                           cycle through the rest.  With no exact\n"
+        "                           match, typos and abbreviations match.\n"
+        "  xcd SEG... SEGMENT  Like SEGMENT, but only dirs with ancestor\n"
+        "                           components matching each SEG, in order.\n"
+        "  xcd -r [SEG...] PATTERN\n"
+        "                      Like SEG..., with the basename matched by the\n"
+        "                           regular expression PATTERN (. [] * + ?\n"
+        "                           | () ^ $ \\d \\w \\s); -l and -p take -r too.\n"
+        "                           A SEGMENT with * ? or [ is a glob that\n"
+        "                           must match the whole basename.\n"
+        "  xcd -w [-r] SEG...  Like SEG..., but only dirs inside the current\n"
+        "                           project (the nearest parent holding .git,\n"
+        "                           .hg or .svn), or else below the current dir.\n"
+        "  xcd -i [SEG...]     Pick a match on the terminal, narrowing the list\n"
+        "                           as you type; Up/Down (Ctrl-P/Ctrl-N) move,\n"
+        "                           Enter goes there, Esc or Ctrl-C gives up.\n"
+        "\n"
+        "Options (management / info; do NOT change directory):\n"
+        "  xcd -h              Show this help.\n"
+        "  xcd -l              List all remembered directories.\n"
+        "  xcd -l SEGMENT      List remembered dirs whose basename contains SEGMENT.\n"
+        "  xcd -l SEG... SEGMENT\n"
+        "                      The same, for a multi-segment query.\n"
+        "  xcd -l DIR/         List remembered dirs at or below DIR (any\n"
+        "                           argument containing a '/').\n"
+        "  xcd -p SEGMENT...   Preview the best matches with their scores and\n"
+        "                           which one would be used next.\n"
+        "  xcd -c              Clear the memory file (~/.xcd_memory, or this\n"
+        "                           host's shard in ~/.xcd_memory.d/).\n"
+        "  xcd -g [--timeout MS] [--budget MS]\n"
+        "                      Check every remembered dir in parallel and\n"
+        "                           remove the dead ones; a path slower than\n"
+        "                           the timeout (default 2000), or not reached\n"
+        "                           within the budget (10000), is kept.\n"
+        "  xcd --stats         Latency percentiles over recent invocations, from\n"
+        "                           the log kept when XCD_LATENCY_LOG is set.\n"
+        "  xcd -s ROOT [--depth N] [--exclude GLOB]...\n"
+        "                      Remember every directory under ROOT (down to\n"
+        "                           depth N), skipping names matching GLOB\n"
+        "                           and .git, .hg, .svn, node_modules and\n"
+        "                           __pycache__; symlinks are not followed.\n"
+        "  xcd -x              Build a binary index (~/.xcd_memory.idx) that is\n"
+        "                           mmap'd on later runs instead of parsing the\n"
+        "                           text file; delete it to go back to text only.\n"
+        "  xcd-core --serve    Keep the memory loaded and answer requests on\n"
+        "                           $XDG_RUNTIME_DIR/xcd-core.sock until killed.\n"
+        "  xcd-core --client ARGS\n"
+        "                      Pass ARGS to the running server; without one,\n"
+        "                           behave exactly like xcd-core ARGS.\n"
+        "  xcd-core --batch [-0]\n"
+        "                      Read -l queries from stdin, one per line (per\n"
+        "                           NUL-terminated record with -0), and answer\n"
+        "                           each with its list and an empty line.\n"
+        "  xcd-core --complete [PREFIX] [--limit N]\n"
+        "                      Print up to N (default 32) remembered\n"
+        "                           basenames starting with PREFIX, best\n"
+        "                           first, for shell completion.\n"
+        "  xcd --trace ARGS    Run ARGS, then print per-phase times and call\n"
+        "                           counts on stderr (or set XCD_TRACE=1).\n"
+        "\n"
+        "Note: wrappers should only 'cd' into the directory printed when\n"
+        "no -h/-l/-p/-c/-g/-s/-x/--stats option is used.\n"
+    );
+}
+
+static void cmd_clear()
+{
+    // Clear in-memory list and swap in an empty file
+    free_memory_list();
+    compact_memory(0);
+}
+
+static void cmd_index()
+{
+    // Compacting gives the index a fresh file to cover in full
+    index_enabled = 1;
+    compact_memory(1);
+    save_index();
+}
+
+static int cmp_ms(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Summarize the latency log: p50/p99/max over the last STATS_RECENT
+// invocations, in total and per phase.
+static void cmd_stats()
+{
+    char path[PATH_MAX];
+    latency_log_path(path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("No latency log at %s; set XCD_LATENCY_LOG=1 to keep one.\n", path);
+        return;
+    }
+
+    // the last STATS_RECENT samples: total, then each phase
+    size_t len = 0;
+    char *tail = latency_tail(fd, STATS_RECENT, &len);
+    close(fd);
+    double (*samples)[PHASE_COUNT + 1] =
+        xrealloc(NULL, STATS_RECENT * sizeof(samples[0]));
+    int n = 0;
+    for (char *line = tail; line && line < tail + len && n < STATS_RECENT; )
+    {
+        char *end = strchr(line, '\n');
+        if (end)
+            *end = '\0';
+        double *v = samples[n];
+        long when;
+        if (sscanf(line, "%ld %lf %lf %lf %lf %lf", &when,
+                   &v[0], &v[1], &v[2], &v[3], &v[4]) == PHASE_COUNT + 2)
+            n++;
+        line = end ? end + 1 : tail + len;
+    }
+    free(tail);
+
+    if (n == 0)
+    {
+        printf("No invocations logged in %s yet.\n", path);
+        free(samples);
+        return;
+    }
+
+    printf("Latency of the last %d logged invocations (%s):\n", n, path);
+    printf("  %-8s %10s %10s %10s\n", "", "p50 ms", "p99 ms", "max ms");
+
+    double *col = xrealloc(NULL, (size_t)n * sizeof(col[0]));
+    for (int c = 0; c <= PHASE_COUNT; c++)
+    {
+        for (int i = 0; i < n; i++)
+            col[i] = samples[i][c];
+        qsort(col, (size_t)n, sizeof(col[0]), cmp_ms);
+
+        printf("  %-8s %10.3f %10.3f %10.3f\n",
+               c == 0 ? "total" : phase_names[c - 1],
+               col[(n - 1) / 2], col[(int)((n - 1) * 0.99 + 0.5)], col[n - 1]);
+    }
+
+    free(col);
+    free(samples);
+}
+
+// Indices of entries whose basename contains segment, in a malloc'd
+// array the caller frees.
+static int find_matches(const char *segment, int **out_indices)
+{
+    int prev = trace_phase(PHASE_MATCH);
+    int count = 0;
+    int cap = 64;
+    int *indices = xrealloc(NULL, (size_t)cap * sizeof(indices[0]));
+    int start = 0;
+
+    // Indexed entries via posting lists; short segments and the delta
+    // added since the index was written by scanning.
+    if (index_count > 0 && strlen(segment) >= 3)
+    {
+        trigram_matches(segment, &indices, &count, &cap);
+        start = index_count;
+    }
+
+    if (start < dir_count)
+        scan_matches(segment, start, &indices, &count, &cap);
+
+    trace_phase(prev);
+    *out_indices = indices;
+    return count;
+}
+
+static int query_regex = 0;  // the last segment is a regular expression (xcd -r)
+
+static int is_glob(const char *segment)
+{
+    return strpbrk(segment, "*?[") != NULL;
+}
+
+// The end of the bracket expression at p, just past its '[', read as
+// parse_bracket() reads it: the ']' closing it, or the end of the pattern.
+static const char *skip_bracket(const char *p, int glob)
+{
+    if (*p == '^' || (glob && *p == '!'))
+        p++;
+
+    for (int first = 1; *p && (*p != ']' || first); first = 0)
+    {
+        int escape = (*p == '\\' && p[1]);
+        int c = (unsigned char)p[escape];
+        p += escape + 1;
+        if (escape && !glob && strchr("dws", c))
+            continue;
+        if (p[0] == '-' && p[1] && p[1] != ']')
+            p += 2; // a range
+    }
+    return p;
+}
+
+// The longest run of bytes every match of pattern src must contain, into
+// buf; "" when there is none worth using (any '|', for one).
+static void pattern_literal(const char *src, int glob, char *buf, size_t size)
+{
+    char run[PATTERN_MAX + 1];
+    size_t len = 0;
+
+    buf[0] = '\0';
+    if (!glob && strchr(src, '|'))
+        return;
+
+    for (const char *p = src; ; p++)
+    {
+        int c = (unsigned char)*p;
+        int literal = 0;
+
+        if (c == '\\' && p[1])
+        {
+            c = (unsigned char)*++p;
+            literal = glob || !strchr("dws", c);
+        }
+        else if (c == '[')
+        {
+            p = skip_bracket(p + 1, glob);
+            if (!*p)
+                p--; // unterminated: let the loop see the end
+        }
+        else if (!glob && c == '(')
+        {
+            for (int depth = 0; *p; p++)
+            {
+                if (*p == '\\' && p[1])
+                    p++;
+                else if (*p == '[')
+                {
+                    p = skip_bracket(p + 1, glob);
+                    if (!*p)
+                        break;
+                }
+                else if (*p == '(')
+                    depth++;
+                else if (*p == ')' && --depth == 0)
+                    break;
+            }
+        }
+        else if (c && !strchr(glob ? "*?" : ".^$*+?)", c))
+            literal = 1;
+
+        // x* and x? may leave out x; x+ may repeat it
+        if (literal && !glob && p[1] && strchr("*?+", p[1]))
+        {
+            if (p[1] == '+')
+                run[len++] = (char)c;
+            literal = 0;
+        }
+
+        if (literal)
+        {
+            run[len++] = (char)c;
+            continue;
+        }
+
+        run[len] = '\0';
+        if (len > strlen(buf) && len < size)
+            memcpy(buf, run, len + 1);
+        len = 0;
+        if (!*p)
+            break;
+    }
+}
+
+// Entries whose basename matches segment as a glob, or with query_regex as
+// a regular expression, in entry order; within query_scope if set.  A
+// literal the pattern requires narrows the candidates first, through the
+// trigram index when there is one.
+static int pattern_matches(const char *segment, int **out_indices)
+{
+    struct pattern pat;
+    if (!pattern_init(&pat, segment, !query_regex))
+    {
+        fprintf(stderr, "xcd-core: bad pattern \"%s\": %s\n", segment, pat.error);
+        pattern_free(&pat);
+        *out_indices = xrealloc(NULL, sizeof(int));
+        return 0;
+    }
+
+    int prev = trace_phase(PHASE_MATCH);
+    int count = 0;
+    int *indices;
+
+    if (query_scope)
+    {
+        int in_order;
+        int n = subtree_entries(query_scope, &indices, &in_order);
+        qsort(indices, (size_t)n, sizeof(indices[0]), cmp_int);
+        for (int i = 0; i < n; i++)
+            if (pattern_match(&pat, entry_base(indices[i])))
+                indices[count++] = indices[i];
+    }
+    else
+    {
+        char literal[PATTERN_MAX + 1];
+        pattern_literal(segment, !query_regex, literal, sizeof(literal));
+
+        if (strlen(literal) >= 3)
+        {
+            int n = find_matches(literal, &indices);
+            for (int i = 0; i < n; i++)
+                if (pattern_match(&pat, entry_base(indices[i])))
+                    indices[count++] = indices[i];
+        }
+        else
+        {
+            int cap = 64;
+            indices = xrealloc(NULL, (size_t)cap * sizeof(indices[0]));
+            for (int i = 0; i < dir_count; i++)
+                if (entry_live(i) && pattern_match(&pat, entry_base(i)))
+                    push_match(&indices, &count, &cap, i);
+        }
+    }
+
+    trace_phase(prev);
+    pattern_free(&pat);
+    *out_indices = indices;
+    return count;
+}
+
+/* A query of several segments, "xcd proj api": the last one must match
+   the basename and the earlier ones, in order, separate ancestor
+   components.  The basename segment gives the candidate set (from the
+   trigram index when there is one); the ancestor segments are not
+   indexed, so each one narrows that set in turn, longest (most
+   selective) first, with a single memmem over a candidate's directory
+   part.  The full in-order rule runs only on what survives.  When no
+   basename contains the last segment exactly, the candidates are its
+   approximate matches instead; ancestor segments are always exact. */
+
+static int query_fuzzy = 0;  // the last find_query() fell back to fuzzy_matches()
+
+// Do segs[0 .. nseg) match distinct components of path's directory part,
+// in order?  Components are matched greedily, leftmost first.
+static int ancestors_match(const char *path, int nseg, char **segs)
+{
+    const char *base = base_name(path);
+    const char *p = path;
+    int k = 0;
+
+    while (k < nseg && p < base)
+    {
+        const char *end = memchr(p, '/', (size_t)(base - p));
+        if (!end)
+            end = base;
+        if (memmem(p, (size_t)(end - p), segs[k], strlen(segs[k])))
+            k++;
+        p = end + 1;
+    }
+    return k == nseg;
+}
+
+// Keep the indices whose directory part contains seg; returns the new count.
+static int filter_ancestor(const char *seg, int *indices, int count)
+{
+    size_t seg_len = strlen(seg);
+    int kept = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        const char *d = entry_path(indices[i]);
+        if (d && memmem(d, (size_t)(base_name(d) - d), seg, seg_len))
+            indices[kept++] = indices[i];
+    }
+    return kept;
+}
+
+// find_query() starting from the segment with the fewest candidates.
+// The basename segment's are bounded by its trigram postings, an ancestor
+// segment's by the subtrees under the names it occurs in; whichever is
+// smallest is read and checked against the others, so a rare project
+// name in front of a common basename costs only its own subtrees.
+// Returns -1 when the basename segment is cheapest (or there is no index
+// to tell, or it is too short to have postings), or nothing matched, for
+// find_query() to proceed as usual.
+static int anchored_query(int nseg, char **segs, int **out_indices)
+{
+    const char *last = segs[nseg - 1];
+    if (query_regex || query_scope || is_glob(last) || strlen(last) < 3 ||
+        !index_name_nodes)
+        return -1;
+
+    // A candidate costs about as much to check as sweeping 512 bytes of
+    // names, and one found through the trie somewhat more than one from
+    // the postings: an ancestor has to promise a quarter of the work.
+    int prev = trace_phase(PHASE_MATCH);
+    long best = trigram_estimate(last);
+    int *indices = NULL;
+    int count = 0;
+
+    for (int k = 0; k < nseg - 1 && best > (long)(index_name_size / 512); k++)
+    {
+        int *found;
+        int n = subtree_candidates(segs[k], best / 4, &found);
+        if (n < 0)
+            continue;
+        free(indices);
+        indices = found;
+        count = n;
+        best = n;
+    }
+    if (!indices)
+    {
+        trace_phase(prev);
+        return -1;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int e = indices[i];
+        if (entry_live(e) && strstr(entry_base(e), last) &&
+            ancestors_match(entry_path(e), nseg - 1, segs))
+            indices[kept++] = e;
+    }
+
+    // and what was added since the index was written
+    int cap = kept + 64;
+    indices = xrealloc(indices, (size_t)cap * sizeof(indices[0]));
+    for (int i = index_count; i < dir_count; i++)
+        if (entry_live(i) && strstr(entry_base(i), last) &&
+            ancestors_match(entry_path(i), nseg - 1, segs))
+            push_match(&indices, &kept, &cap, i);
+
+    trace_phase(prev);
+    if (kept == 0)
+    {
+        free(indices);
+        return -1;
+    }
+    query_fuzzy = 0;
+    *out_indices = indices;
+    return kept;
+}
+
+// Like find_matches(), for segs[0 .. nseg) with the last one the basename.
+static int find_query(int nseg, char **segs, int **out_indices)
+{
+    int count;
+
+    if (nseg > 1 && (count = anchored_query(nseg, segs, out_indices)) >= 0)
+        return count;
+
+    if (query_regex || is_glob(segs[nseg - 1]))
+    {
+        count = pattern_matches(segs[nseg - 1], out_indices);
+        query_fuzzy = 0;
+    }
+    else if (query_scope)
+        count = scope_matches(segs[nseg - 1], out_indices, &query_fuzzy);
+    else
+    {
+        count = find_matches(segs[nseg - 1], out_indices);
+
+        query_fuzzy = (count == 0 && segs[nseg - 1][0] != '\0');
+        if (query_fuzzy)
+        {
+            free(*out_indices);
+            count = fuzzy_matches(segs[nseg - 1], out_indices);
+        }
+    }
+    if (nseg == 1)
+        return count;
+
+    int prev = trace_phase(PHASE_MATCH);
+    int *indices = *out_indices;
+
+    // Ancestor segments by decreasing length; a handful at most.
+    int *order = xrealloc(NULL, (size_t)(nseg - 1) * sizeof(order[0]));
+    for (int k = 0; k < nseg - 1; k++)
+    {
+        int j = k;
+        while (j > 0 && strlen(segs[order[j - 1]]) < strlen(segs[k]))
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = k;
+    }
+    for (int k = 0; k < nseg - 1 && count > 0; k++)
+        count = filter_ancestor(segs[order[k]], indices, count);
+    free(order);
+
+    int kept = 0;
+    for (int i = 0; i < count; i++)
+        if (ancestors_match(entry_path(indices[i]), nseg - 1, segs))
+            indices[kept++] = indices[i];
+
+    trace_phase(prev);
+    return kept;
+}
+
+// The segments joined by spaces, for messages.
+static const char *query_text(int nseg, char **segs)
+{
+    static char text[PATH_MAX];
+    size_t len = 0;
+
+    text[0] = '\0';
+    for (int k = 0; k < nseg && len < sizeof(text) - 1; k++)
+        len += (size_t)snprintf(text + len, sizeof(text) - len, "%s%s",
+                                k ? " " : "", segs[k]);
+    return text;
+}
+
+static char list_sep = '\n';  // ends each listed path; '\0' for --batch -0
+
+static void list_entry(int i)
+{
+    fputs(entry_path(i), stdout);
+    putchar(list_sep);
+}
+
+// xcd -l DIR: the remembered directories at or below DIR, in path order.
+static void list_subtree(const char *arg)
+{
+    char buf[PATH_MAX];
+    const char *prefix = canonical_path(arg, buf, sizeof(buf));
+    if (!prefix)
+    {
+        if (arg[0] != '/')
+        {
+            fprintf(stderr, "xcd-core: no such directory: %s\n", arg);
+            return;
+        }
+        // Gone from disk, but its entries may still be remembered.
+        snprintf(buf, sizeof(buf), "%s", arg);
+        size_t n = strlen(buf);
+        while (n > 1 && buf[n - 1] == '/')
+            buf[--n] = '\0';
+        prefix = buf;
+    }
+
+    int prev = trace_phase(PHASE_MATCH);
+    int in_order;
+    int *indices;
+    int count = subtree_entries(prefix, &indices, &in_order);
+    if (!in_order)
+        qsort(indices, (size_t)count, sizeof(indices[0]), path_order);
+    trace_phase(prev);
+
+    for (int i = 0; i < count; i++)
+        if (check_dir(indices[i]))
+            list_entry(indices[i]);
+
+    free(indices);
+}
+
+static void cmd_list(int nseg, char **segs)
+{
+    if (nseg == 1 && strchr(segs[0], '/') && !query_regex)
+    {
+        list_subtree(segs[0]);
+        return;
+    }
+
+    if (nseg == 0 || segs[nseg - 1][0] == '\0')
+    {
+        // list all
+        for (int i = 0; i < dir_count; i++)
+            if (entry_path(i) && check_dir(i))
+                list_entry(i);
+    }
+    else
+    {
+        int *indices;
+        int count = find_query(nseg, segs, &indices);
+
+        for (int i = 0; i < count; i++)
+            if (check_dir(indices[i]))
+                list_entry(indices[i]);
+
+        free(indices);
+    }
+}
+
+/* ---------- Garbage collection ---------- */
+
+/* xcd -g checks every remembered directory and drops the dead ones, so
+   stale entries need not wait to be stumbled upon one at a time.  Each
+   path is resolved with realpath(): one that now goes through a symlink
+   or was reached by another name is folded into the entry for where it
+   leads, its visits added and the later last visit kept.  The lookups
+   run on a pool of detached threads, since on NFS or automounted paths
+   the time goes into waiting on the server, not the CPU.  A lookup
+   cannot be interrupted, so a path taking longer than the timeout is
+   given up on (and kept) and its worker replaced; whatever is unfinished
+   when the overall budget runs out is kept too.  Threads still stuck at
+   that point hold a reference to the job, which the last one out frees,
+   so nothing they touch goes away under them. */
+
+#define GC_THREADS     16     // lookups in flight at once
+#define GC_MAX_THREADS 64     // counting replacements for stuck ones
+#define GC_TIMEOUT     2000   // ms before a single path is given up on
+#define GC_BUDGET      10000  // ms for the whole sweep
+#define GC_TICK        50     // ms between checks for stuck paths
+
+enum { GC_PENDING, GC_LIVE, GC_DEAD, GC_SLOW };
+
+struct gc_job
+{
+    pthread_mutex_t lock;
+    pthread_cond_t progress;  // a path finished
+    char *pool;               // copies of the paths, NUL-terminated
+    size_t *offset;           // of path k in pool
+    char **canon;             // where path k resolves, if elsewhere
+    int *entry;               // dirs[] index of path k
+    unsigned char *state;     // GC_*
+    double *started;          // clock_ms() when a worker took path k
+    int count;
+    int next;                 // next path to hand out
+    int finished;             // paths no longer GC_PENDING
+    int stop;                 // hand out no more paths
+    int refs;                 // the caller plus running workers
+};
+
+static void gc_release(struct gc_job *job)
+{
+    pthread_mutex_lock(&job->lock);
+    int last = (--job->refs == 0);
+    pthread_mutex_unlock(&job->lock);
+    if (!last)
+        return;
+
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->progress);
+    free(job->pool);
+    free(job->offset);
+    for (int k = 0; k < job->count; k++)
+        free(job->canon[k]);
+    free(job->canon);
+    free(job->entry);
+    free(job->state);
+    free(job->started);
+    free(job);
+}
+
+static void *gc_worker(void *arg)
+{
+    struct gc_job *job = arg;
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->stop && job->next < job->count)
+    {
+        int k = job->next++;
+        job->started[k] = clock_ms();
+        pthread_mutex_unlock(&job->lock);
+
+        const char *path = job->pool + job->offset[k];
+        char canon[PATH_MAX];
+        struct stat st;
+        int live = realpath(path, canon) && stat(canon, &st) == 0 &&
+                   S_ISDIR(st.st_mode);
+        char *moved = (live && strcmp(canon, path) != 0) ? strdup(canon) : NULL;
+
+        pthread_mutex_lock(&job->lock);
+        if (job->state[k] == GC_PENDING)
+        {
+            job->state[k] = live ? GC_LIVE : GC_DEAD;
+            job->canon[k] = moved;
+            job->finished++;
+            pthread_cond_signal(&job->progress);
+        }
+        else
+        {
+            // given up on while we waited; a fresh worker took our place
+            free(moved);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    gc_release(job);
+    return NULL;
+}
+
+// Start a detached worker holding a reference; job->lock must be held.
+static int gc_spawn(struct gc_job *job)
+{
+    pthread_t t;
+
+    job->refs++;
+    if (pthread_create(&t, NULL, gc_worker, job) != 0)
+    {
+        job->refs--;
+        return 0;
+    }
+    pthread_detach(t);
+    return 1;
+}
+
+// Fold entry j, found to be an alias, into the entry for canon (added if
+// there is none yet).
+static void gc_merge(int j, const char *canon)
+{
+    int i = find_dir(canon);
+    if (i < 0)
+        i = append_dir(arena_strdup(canon));
+
+    printf("Merged %s into %s\n", entry_path(j), canon);
+    dir_visits[i] += dir_visits[j];
+    if (dir_last[j] > dir_last[i])
+        dir_last[i] = dir_last[j];
+    dir_peer_visits[i] += dir_peer_visits[j];
+    if (dir_peer_last[j] > dir_peer_last[i])
+        dir_peer_last[i] = dir_peer_last[j];
+    set_peer(i, 0); // journaled here from now on
+    drop_dir(j);
+}
+
+// Parse "--timeout MS" / "--budget MS" style values.
+static int gc_option(const char *value, int *out)
+{
+    char *end;
+    long ms = value ? strtol(value, &end, 10) : 0;
+
+    if (!value || *end != '\0' || ms <= 0 || ms > 24L * 60 * 60 * 1000)
+        return 0;
+    *out = (int)ms;
+    return 1;
+}
+
+static int cmd_gc(int argc, char **argv)
+{
+    int timeout = GC_TIMEOUT, budget = GC_BUDGET;
+
+    for (int a = 0; a < argc; a += 2)
+    {
+        int ok = 0;
+        if (strcmp(argv[a], "--timeout") == 0)
+            ok = gc_option(a + 1 < argc ? argv[a + 1] : NULL, &timeout);
+        else if (strcmp(argv[a], "--budget") == 0)
+            ok = gc_option(a + 1 < argc ? argv[a + 1] : NULL, &budget);
+        if (!ok)
+        {
+            fprintf(stderr, "xcd-core: usage: -g [--timeout MS] [--budget MS]\n");
+            return 1;
+        }
+    }
+
+    double t0 = clock_ms();
+    struct gc_job *job = xrealloc(NULL, sizeof(*job));
+    memset(job, 0, sizeof(*job));
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->progress, NULL);
+
+    // Copy the paths out: the workers may outlive dirs[] and the index map.
+    size_t pool_len = 0;
+    for (int i = 0; i < dir_count; i++)
+        if (entry_path(i))
+        {
+            job->count++;
+            pool_len += strlen(entry_path(i)) + 1;
+        }
+    int n = job->count;
+    job->pool = xrealloc(NULL, pool_len ? pool_len : 1);
+    job->offset = xrealloc(NULL, (size_t)(n ? n : 1) * sizeof(job->offset[0]));
+    job->entry = xrealloc(NULL, (size_t)(n ? n : 1) * sizeof(job->entry[0]));
+    job->canon = calloc((size_t)(n ? n : 1), sizeof(job->canon[0]));
+    job->state = calloc((size_t)(n ? n : 1), sizeof(job->state[0]));
+    job->started = calloc((size_t)(n ? n : 1), sizeof(job->started[0]));
+    if (!job->canon || !job->state || !job->started)
+    {
+        fprintf(stderr, "xcd-core: out of memory\n");
+        fatal_exit();
+    }
+    size_t pos = 0;
+    for (int i = 0, k = 0; i < dir_count; i++)
+        if (entry_path(i))
+        {
+            size_t len = strlen(entry_path(i)) + 1;
+            memcpy(job->pool + pos, entry_path(i), len);
+            job->offset[k] = pos;
+            job->entry[k++] = i;
+            pos += len;
+        }
+
+    pthread_mutex_lock(&job->lock);
+    job->refs = 1;
+    int threads = 0;
+    while (threads < GC_THREADS && threads < n && gc_spawn(job))
+        threads++;
+
+    int slow = 0;
+    int low = 0;  // paths below low are all finished
+    double deadline = t0 + budget;
+    while (job->finished < n && threads > 0)
+    {
+        double now = clock_ms();
+        if (now >= deadline)
+            break;
+
+        // Give up on paths stuck past the timeout; their workers exit
+        // when (if) the stat returns, so start replacements.
+        while (low < job->next && job->state[low] != GC_PENDING)
+            low++;
+        for (int k = low; k < job->next; k++)
+            if (job->state[k] == GC_PENDING && now - job->started[k] >= timeout)
+            {
+                job->state[k] = GC_SLOW;
+                job->finished++;
+                slow++;
+                if (threads < GC_MAX_THREADS && gc_spawn(job))
+                    threads++;
+            }
+
+        double wake = now + GC_TICK;
+        if (wake > deadline)
+            wake = deadline;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        long ns = ts.tv_nsec + (long)((wake - now) * 1e6);
+        ts.tv_sec += ns / 1000000000L;
+        ts.tv_nsec = ns % 1000000000L;
+        pthread_cond_timedwait(&job->progress, &job->lock, &ts);
+    }
+    job->stop = 1;
+
+    int removed = 0, merged = 0, unchecked = 0;
+    for (int k = 0; k < n; k++)
+    {
+        if (job->state[k] == GC_DEAD)
+        {
+            printf("Removed %s\n", entry_path(job->entry[k]));
+            drop_dir(job->entry[k]);
+            removed++;
+        }
+        else if (job->state[k] == GC_LIVE && job->canon[k])
+        {
+            gc_merge(job->entry[k], job->canon[k]);
+            merged++;
+        }
+        else if (job->state[k] == GC_PENDING)
+        {
+            unchecked++;
+        }
+    }
+    trace.realpaths += n - unchecked;
+    trace.stats += n - unchecked;
+    pthread_mutex_unlock(&job->lock);
+    gc_release(job);
+
+    // Rewrite now rather than whenever the caller saves (the server
+    // batches its writes).
+    if (removed || merged)
+        compact_memory(1);
+
+    printf("Checked %d of %d directories in %.0f ms: %d removed",
+           n - unchecked - slow, n, clock_ms() - t0, removed);
+    if (merged)
+        printf(", %d merged", merged);
+    if (slow)
+        printf(", %d kept after %d ms without an answer", slow, timeout);
+    if (unchecked)
+        printf(", %d kept unchecked when the %d ms budget ran out",
+               unchecked, budget);
+    printf(".\n");
+    return 0;
+}
+
+/* ---------- Crawler ---------- */
+
+/* xcd -s ROOT remembers every directory under ROOT, so a fresh checkout is
+   searchable before it has been visited.  ROOT is canonicalized once;
+   below it each path is its parent's plus a name, and symlinks are not
+   followed, so every path found is already canonical and no realpath() or
+   per-entry stat() is needed (d_type says what is a directory).  A
+   directory is opened relative to its parent's still open handle, so the
+   kernel resolves one name rather than the whole path again; the handle
+   is closed once the last of its subdirectories has been opened.
+   Directories are listed by a pool of threads, each with its own deque of
+   directories still to list: a thread takes its newest (depth first,
+   which keeps the deque short), and an idle thread steals the oldest from
+   another's, which is the root of the largest untouched subtree; a thread
+   with nothing to take or steal sleeps until a push wakes it.  Each
+   thread copies the paths it finds into arena chunks of its own; those
+   are handed to the store afterwards, which appends the new ones in a
+   single journal write. */
+
+#define CRAWL_MAX_THREADS 32
+#define CRAWL_MAX_EXCLUDES 64
+#define CRAWL_MAX_HELD 256      // directory handles kept open for openat()
+
+// An open directory whose subdirectories are still queued.
+struct crawl_dir
+{
+    DIR *dir;
+    int refs;                   // queued subdirectories, plus the lister
+};
+
+struct crawl_item
+{
+    struct crawl_dir *parent;   // NULL: open path itself
+    char *path;
+    const char *name;           // last component of path
+    int depth;
+};
+
+struct crawl_worker
+{
+    pthread_mutex_t lock;       // guards the deque
+    struct crawl_item *items;   // deque: thieves take items[head],
+    int head, tail, cap;        // the owner pushes and pops at tail
+    struct arena_chunk *arena;  // every path this worker found
+    int id;
+};
+
+static struct crawl_worker *crawl_workers;
+static int crawl_threads;
+static long crawl_pending;      // directories queued or being listed
+static long crawl_pushes;       // bumped on every push, for idle workers
+static int crawl_sleepers;      // idle workers waiting on crawl_wake
+static pthread_mutex_t crawl_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t crawl_wake = PTHREAD_COND_INITIALIZER;
+static int crawl_max_depth;
+static const char *crawl_excludes[CRAWL_MAX_EXCLUDES];
+static int crawl_exclude_count;
+static int crawl_held;          // crawl_dirs currently open
+
+static void crawl_push(struct crawl_worker *w, struct crawl_dir *parent,
+                       char *path, const char *name, int depth)
+{
+    __atomic_add_fetch(&crawl_pending, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == w->cap)
+    {
+        // slide the live items down before growing
+        int live = w->tail - w->head;
+        memmove(w->items, w->items + w->head, (size_t)live * sizeof(w->items[0]));
+        w->head = 0;
+        w->tail = live;
+        if (live * 2 >= w->cap)
+        {
+            w->cap = w->cap ? w->cap * 2 : 256;
+            w->items = xrealloc(w->items, (size_t)w->cap * sizeof(w->items[0]));
+        }
+    }
+    w->items[w->tail].parent = parent;
+    w->items[w->tail].path = path;
+    w->items[w->tail].name = name;
+    w->items[w->tail].depth = depth;
+    w->tail++;
+    pthread_mutex_unlock(&w->lock);
+
+    // Either an idle worker sees the new count before it waits, or we see
+    // it counted among the sleepers and wake it.
+    __atomic_add_fetch(&crawl_pushes, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&crawl_sleepers, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&crawl_idle_lock);
+        pthread_cond_signal(&crawl_wake);
+        pthread_mutex_unlock(&crawl_idle_lock);
+    }
+}
+
+// Take an item from w's own end (newest) or, for a thief, the other (oldest).
+static int crawl_take(struct crawl_worker *w, int steal, struct crawl_item *out)
+{
+    int ok = 0;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail)
+    {
+        *out = steal ? w->items[w->head++] : w->items[--w->tail];
+        ok = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+// parent + "/" + name, in w's arena.
+static char *crawl_path(struct crawl_worker *w, const char *parent,
+                        const char *name)
+{
+    size_t plen = strlen(parent), nlen = strlen(name);
+    if (plen == 1)
+        plen = 0; // ROOT is "/"
+    size_t n = plen + 1 + nlen + 1;
+
+    if (!w->arena || w->arena->size - w->arena->used < n)
+    {
+        size_t size = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+        struct arena_chunk *c = xrealloc(NULL, sizeof(*c) + size);
+        c->next = w->arena;
+        c->used = 0;
+        c->size = size;
+        w->arena = c;
+    }
+
+    char *p = w->arena->data + w->arena->used;
+    memcpy(p, parent, plen);
+    p[plen] = '/';
+    memcpy(p + plen + 1, name, nlen + 1);
+    w->arena->used += n;
+    return p;
+}
+
+static void crawl_release(struct crawl_dir *cd)
+{
+    if (cd && __atomic_sub_fetch(&cd->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        closedir(cd->dir);
+        free(cd);
+        __atomic_sub_fetch(&crawl_held, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static int crawl_excluded(const char *name)
+{
+    for (int k = 0; k < crawl_exclude_count; k++)
+        if (fnmatch(crawl_excludes[k], name, 0) == 0)
+            return 1;
+    return 0;
+}
+
+static void crawl_list(struct crawl_worker *w, const struct crawl_item *item)
+{
+    const int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    int fd = item->parent ? openat(dirfd(item->parent->dir), item->name, flags)
+                          : open(item->path, flags);
+    crawl_release(item->parent);
+    if (fd < 0)
+        return;
+    DIR *d = fdopendir(fd);
+    if (!d)
+    {
+        close(fd);
+        return;
+    }
+
+    // Keep d open for the subdirectories, unless too many already are.
+    struct crawl_dir *cd = NULL;
+    if (item->depth + 1 < crawl_max_depth &&
+        __atomic_add_fetch(&crawl_held, 1, __ATOMIC_RELAXED) <= CRAWL_MAX_HELD)
+    {
+        cd = xrealloc(NULL, sizeof(*cd));
+        cd->dir = d;
+        cd->refs = 1;
+    }
+    else if (item->depth + 1 < crawl_max_depth)
+    {
+        __atomic_sub_fetch(&crawl_held, 1, __ATOMIC_RELAXED);
+    }
+
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL)
+    {
+        const char *name = e->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+
+        int is_sub = (e->d_type == DT_DIR);
+        if (e->d_type == DT_UNKNOWN)
+        {
+            // some filesystems leave d_type out
+            struct stat st;
+            is_sub = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                     S_ISDIR(st.st_mode);
+        }
+        if (!is_sub || crawl_excluded(name))
+            continue;
+
+        char *path = crawl_path(w, item->path, name);
+        if (item->depth + 1 < crawl_max_depth)
+        {
+            if (cd)
+                __atomic_add_fetch(&cd->refs, 1, __ATOMIC_RELAXED);
+            crawl_push(w, cd, path, strrchr(path, '/') + 1, item->depth + 1);
+        }
+    }
+    if (cd)
+        crawl_release(cd);
+    else
+        closedir(d);
+}
+
+static void *crawl_worker_main(void *arg)
+{
+    struct crawl_worker *w = arg;
+    struct crawl_item item;
+
+    for (;;)
+    {
+        long pushes = __atomic_load_n(&crawl_pushes, __ATOMIC_SEQ_CST);
+        int got = crawl_take(w, 0, &item);
+        for (int k = 1; !got && k < crawl_threads; k++)
+            got = crawl_take(&crawl_workers[(w->id + k) % crawl_threads], 1, &item);
+
+        if (!got)
+        {
+            // Nothing to steal: done once nobody is listing either, else
+            // sleep until a push or the last listing finishing wakes us.
+            if (__atomic_load_n(&crawl_pending, __ATOMIC_ACQUIRE) == 0)
+                break;
+            pthread_mutex_lock(&crawl_idle_lock);
+            __atomic_add_fetch(&crawl_sleepers, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&crawl_pushes, __ATOMIC_SEQ_CST) == pushes &&
+                __atomic_load_n(&crawl_pending, __ATOMIC_ACQUIRE) > 0)
+                pthread_cond_wait(&crawl_wake, &crawl_idle_lock);
+            __atomic_sub_fetch(&crawl_sleepers, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&crawl_idle_lock);
+            continue;
+        }
+
+        crawl_list(w, &item);
+        if (__atomic_sub_fetch(&crawl_pending, 1, __ATOMIC_RELEASE) == 0)
+        {
+            pthread_mutex_lock(&crawl_idle_lock);
+            pthread_cond_broadcast(&crawl_wake);
+            pthread_mutex_unlock(&crawl_idle_lock);
+        }
+    }
+    return NULL;
+}
+
+// Parse a --depth value.
+static int crawl_depth(const char *value, int *out)
+{
+    char *end;
+    long n = value ? strtol(value, &end, 10) : 0;
+
+    if (!value || *end != '\0' || n < 0 || n > INT_MAX)
+        return 0;
+    *out = (int)n;
+    return 1;
+}
+
+static int cmd_seed(int argc, char **argv)
+{
+    static const char *default_excludes[] =
+    {
+        ".git", ".hg", ".svn", "node_modules", "__pycache__",
+    };
+    const char *root = NULL;
+
+    crawl_max_depth = INT_MAX;
+    crawl_exclude_count = 0;
+    for (size_t k = 0; k < sizeof(default_excludes) / sizeof(default_excludes[0]); k++)
+        crawl_excludes[crawl_exclude_count++] = default_excludes[k];
+
+    int ok = 1;
+    for (int a = 0; a < argc && ok; a++)
+    {
+        if (strcmp(argv[a], "--depth") == 0)
+        {
+            ok = crawl_depth(a + 1 < argc ? argv[++a] : NULL, &crawl_max_depth);
+        }
+        else if (strcmp(argv[a], "--exclude") == 0)
+        {
+            ok = a + 1 < argc && crawl_exclude_count < CRAWL_MAX_EXCLUDES;
+            if (ok)
+                crawl_excludes[crawl_exclude_count++] = argv[++a];
+        }
+        else if (!root)
+        {
+            root = argv[a];
+        }
+        else
+        {
+            ok = 0;
+        }
+    }
+    if (!ok || !root)
+    {
+        fprintf(stderr, "xcd-core: usage: -s ROOT [--depth N] [--exclude GLOB]...\n");
+        return 1;
+    }
+
+    char canon[PATH_MAX];
+    if (!is_dir(root) || !canonical_path(root, canon, sizeof(canon)))
+    {
+        fprintf(stderr, "xcd-core: not a directory: %s\n", root);
+        return 1;
+    }
+
+    double t0 = clock_ms();
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    // listing waits on the disk as much as the CPU: two threads per core
+    crawl_threads = (cpus < 2) ? 4 : (int)(cpus * 2);
+    if (crawl_threads > CRAWL_MAX_THREADS)
+        crawl_threads = CRAWL_MAX_THREADS;
+    crawl_workers = xrealloc(NULL, (size_t)crawl_threads * sizeof(crawl_workers[0]));
+    memset(crawl_workers, 0, (size_t)crawl_threads * sizeof(crawl_workers[0]));
+    crawl_pending = 0;
+    crawl_pushes = 0;
+
+    pthread_t *threads = xrealloc(NULL, (size_t)crawl_threads * sizeof(threads[0]));
+    for (int t = 0; t < crawl_threads; t++)
+    {
+        pthread_mutex_init(&crawl_workers[t].lock, NULL);
+        crawl_workers[t].id = t;
+    }
+
+    int added = 0;
+    if (find_dir(canon) < 0)
+    {
+        append_dir(arena_strdup(canon));
+        added++;
+    }
+
+    if (crawl_max_depth > 0)
+    {
+        crawl_held = 0;
+        crawl_push(&crawl_workers[0], NULL, canon, canon, 0);
+
+        int started = 0;
+        for (; started < crawl_threads; started++)
+            if (pthread_create(&threads[started], NULL, crawl_worker_main,
+                               &crawl_workers[started]) != 0)
+                break;
+        if (started == 0)
+            crawl_worker_main(&crawl_workers[0]);
+        for (int t = 0; t < started; t++)
+            pthread_join(threads[t], NULL);
+    }
+
+    // Adopt the workers' chunks; the paths in them become the new entries.
+    long found = 0;
+    for (int t = 0; t < crawl_threads; t++)
+    {
+        struct crawl_worker *w = &crawl_workers[t];
+        while (w->arena)
+        {
+            struct arena_chunk *c = w->arena;
+            w->arena = c->next;
+            for (size_t pos = 0; pos < c->used; )
+            {
+                char *p = c->data + pos;
+                pos += strlen(p) + 1;
+                found++;
+                if (find_dir(p) < 0)
+                {
+                    append_dir(p);
+                    added++;
+                }
+            }
+            c->next = arena;
+            arena = c;
+        }
+        pthread_mutex_destroy(&w->lock);
+        free(w->items);
+    }
+    free(crawl_workers);
+    free(threads);
+    crawl_workers = NULL;
+
+    if (added)
+        memory_dirty = 1;
+    printf("Found %ld directories under %s in %.0f ms; %d new, %d remembered in all.\n",
+           found + 1, canon, clock_ms() - t0, added, live_count());
+    return 0;
+}
+
+/* ---------- Ranking ---------- */
+
+/* Matches are ranked by frecency: the visit count weighted by how long ago
+   the last visit was, ties going to the entry remembered first.  Only the
+   best match (or the next one while cycling) and the rows -p prints are
+   ever needed, so nothing sorts the whole match list. */
+
+#define PREVIEW_ROWS 30
+
+static double frecency(int i, uint32_t now)
+{
+    uint32_t last = (dir_peer_last[i] > dir_last[i]) ? dir_peer_last[i] : dir_last[i];
+    uint32_t age = (now > last) ? now - last : 0;
+    double w;
+
+    if (age < 60 * 60)
+        w = 4.0;
+    else if (age < 24 * 60 * 60)
+        w = 2.0;
+    else if (age < 7 * 24 * 60 * 60)
+        w = 0.5;
+    else
+        w = 0.25;
+
+    return (dir_visits[i] + dir_peer_visits[i]) * w;
+}
+
+// Does entry a rank ahead of entry b?
+static int ranks_before(int a, int b, uint32_t now)
+{
+    double sa = frecency(a, now);
+    double sb = frecency(b, now);
+    if (sa != sb)
+        return sa > sb;
+    return a < b;
+}
+
+// Position of entry here (the current directory) within the match list,
+// or -1 if it is not there.
+static int cycle_position(const int *indices, int count, int here)
+{
+    for (int i = 0; here >= 0 && i < count; i++)
+        if (indices[i] == here)
+            return i;
+    return -1;
+}
+
+// Remove match i from the list after its entry turned out to be dead.
+static void unlink_match(int *indices, int *count, int i)
+{
+    memmove(&indices[i], &indices[i + 1],
+            (size_t)(*count - i - 1) * sizeof(indices[0]));
+    (*count)--;
+}
+
+// Position of the match to jump to: the best one, or while cycling (cur is
+// the entry we are in) the one ranked right after cur, wrapping around.
+static int next_match(const int *indices, int count, int cur, uint32_t now)
+{
+    int best = -1;      // best overall
+    int after = -1;     // best of those ranked after cur
+
+    for (int i = 0; i < count; i++)
+    {
+        int e = indices[i];
+        if (best < 0 || ranks_before(e, indices[best], now))
+            best = i;
+        if (cur >= 0 && e != cur && ranks_before(cur, e, now) &&
+            (after < 0 || ranks_before(e, indices[after], now)))
+            after = i;
+    }
+
+    return (after >= 0) ? after : best;
+}
+
+// next_match(), validating only the chosen entry and dropping dead ones.
+// Returns -1 once nothing is left.
+static int pick_target(int *indices, int *count, int cur, uint32_t now)
+{
+    while (*count > 0)
+    {
+        int next = next_match(indices, *count, cur, now);
+        if (check_dir(indices[next]))
+            return next;
+        unlink_match(indices, count, next);
+    }
+    return -1;
+}
+
+// Number of matches ranked ahead of entry e.
+static int match_rank(const int *indices, int count, int e, uint32_t now)
+{
+    int rank = 0;
+    for (int i = 0; i < count; i++)
+        if (ranks_before(indices[i], e, now))
+            rank++;
+    return rank;
+}
+
+/* Move the best k matches to the front of indices, best first, with a
+   bounded min-heap: O(m log k) rather than sorting all m matches. */
+
+static void heap_sift_down(int *heap, int n, int i, uint32_t now)
+{
+    for (;;)
+    {
+        int worst = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+        if (l < n && ranks_before(heap[worst], heap[l], now))
+            worst = l;
+        if (r < n && ranks_before(heap[worst], heap[r], now))
+            worst = r;
+        if (worst == i)
+            return;
+        int t = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = t;
+        i = worst;
+    }
+}
+
+static int select_top(int *indices, int count, int k, uint32_t now)
+{
+    if (k > count)
+        k = count;
+    if (k == 0)
+        return 0;
+
+    // indices[0 .. k) is a heap with the weakest kept match at the root
+    for (int i = k / 2 - 1; i >= 0; i--)
+        heap_sift_down(indices, k, i, now);
+
+    for (int i = k; i < count; i++)
+    {
+        if (ranks_before(indices[i], indices[0], now))
+        {
+            int t = indices[0];
+            indices[0] = indices[i];
+            indices[i] = t;
+            heap_sift_down(indices, k, 0, now);
+        }
+    }
+
+    // pop the weakest to the back until the front is sorted best first
+    for (int n = k - 1; n > 0; n--)
+    {
+        int t = indices[0];
+        indices[0] = indices[n];
+        indices[n] = t;
+        heap_sift_down(indices, n, 0, now);
+    }
+
+    return k;
+}
+
+static void cmd_preview(int nseg, char **segs)
+{
+    if (nseg == 0 || segs[nseg - 1][0] == '\0')
+    {
+        fprintf(stderr, "xcd-core: -p requires a segment\n");
+        return;
+    }
+
+    const char *segment = query_text(nseg, segs);
+    int *indices;
+    int count = find_query(nseg, segs, &indices);
+    uint32_t now = (uint32_t)time(NULL);
+
+    int cur_pos = cycle_position(indices, count, locate_dir(".", 0));
+    int cur = (cur_pos >= 0) ? indices[cur_pos] : -1;
+
+    // Choose the target first; it reorders nothing, only drops dead entries.
+    int next = pick_target(indices, &count, cur, now);
+    if (next < 0)
+    {
+        printf("No matches for \"%s\".\n", segment);
+        free(indices);
+        return;
+    }
+    int target = indices[next];
+
+    // Only the printed rows are validated; refill the top after drops.
+    int rows;
+    for (;;)
+    {
+        rows = select_top(indices, count, PREVIEW_ROWS, now);
+        int dead = 0;
+        for (int i = 0; i < rows; )
+        {
+            if (check_dir(indices[i]))
+            {
+                i++;
+            }
+            else
+            {
+                unlink_match(indices, &count, i);
+                rows--;
+                dead = 1;
+            }
+        }
+        if (!dead)
+            break;
+    }
+
+    printf("%s for \"%s\", best first:\n",
+           query_fuzzy ? "No exact matches; approximate matches" : "Matches",
+           segment);
+    for (int i = 0; i < rows; i++)
+    {
+        const char *mark = (indices[i] == cur) ? "*" : " ";
+        printf("  [%d]%s %8.2f  %s\n", i, mark,
+               frecency(indices[i], now), entry_path(indices[i]));
+    }
+    if (count > rows)
+        printf("  ... and %d more\n", count - rows);
+
+    if (cur >= 0)
+        printf("Current directory is at rank [%d].\n",
+               match_rank(indices, count, cur, now));
+    else
+        printf("Current directory is not in the match list.\n");
+
+    printf("Next target for segment \"%s\": [%d] %s\n",
+           segment, match_rank(indices, count, target, now), entry_path(target));
+
+    free(indices);
+}
+
+/* ---------- Completion ---------- */
+
+/* xcd-core --complete PREFIX prints, one per line, the basenames starting
+   with PREFIX that the shell should offer, best first and each name once.
+   A visited entry always outranks one never visited (frecency above 0),
+   and unvisited ones tie and fall back to entry order.  The visited
+   entries, a small minority, are bucketed by their visit count (from the
+   count columns alone) and their names checked from the most visited
+   bucket down; once enough names score above anything the next bucket
+   could reach, the rest are left alone.  Only if that leaves the limit
+   unmet are the never-visited ones taken, in order, from a sweep of the
+   basename column that stops as soon as the limit is reached.  Nothing is
+   stat()ed: a Tab press must stay cheap, and a dead name costs no more
+   than a wrong guess. */
+
+#define COMPLETE_LIMIT 32
+#define COMPLETE_BUCKETS 33     // by bit length of the visit count
+
+// A small open-addressing set of names, for printing each one once.
+struct name_set
+{
+    const char **slots;
+    size_t cap;                 // power of two, at least twice the names
+};
+
+static void name_set_init(struct name_set *set, size_t n)
+{
+    set->cap = 16;
+    while (set->cap < n * 2)
+        set->cap *= 2;
+    set->slots = xrealloc(NULL, set->cap * sizeof(set->slots[0]));
+    memset(set->slots, 0, set->cap * sizeof(set->slots[0]));
+}
+
+// Add name; returns 1 if it was not there yet.
+static int name_set_add(struct name_set *set, const char *name)
+{
+    size_t mask = set->cap - 1;
+    size_t slot = hash_path(name) & mask;
+    for (; set->slots[slot]; slot = (slot + 1) & mask)
+        if (strcmp(set->slots[slot], name) == 0)
+            return 0;
+    set->slots[slot] = name;
+    return 1;
+}
+
+// Have at least limit names among indices[0 .. n) a frecency above bound?
+static int complete_settled(const int *indices, int n, int limit,
+                            double bound, uint32_t now)
+{
+    struct name_set seen;
+    int names = 0;
+
+    name_set_init(&seen, (size_t)n);
+    for (int k = 0; k < n && names < limit; k++)
+        if (frecency(indices[k], now) > bound &&
+            name_set_add(&seen, entry_base(indices[k])))
+            names++;
+    free(seen.slots);
+    return names >= limit;
+}
+
+static int cmd_complete(int argc, char **argv)
+{
+    const char *prefix = NULL;
+    int limit = COMPLETE_LIMIT;
+    int ok = 1;
+
+    for (int a = 0; a < argc && ok; a++)
+    {
+        if (strcmp(argv[a], "--limit") == 0)
+        {
+            char *end;
+            long n = (a + 1 < argc) ? strtol(argv[++a], &end, 10) : 0;
+            ok = (n > 0 && n <= 10000 && *end == '\0');
+            limit = (int)n;
+        }
+        else if (!prefix)
+        {
+            prefix = argv[a];
+        }
+        else
+        {
+            ok = 0;
+        }
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "xcd-core: usage: --complete [PREFIX] [--limit N]\n");
+        return 1;
+    }
+    if (!prefix)
+        prefix = "";
+
+    int prev = trace_phase(PHASE_MATCH);
+    size_t plen = strlen(prefix);
+    uint32_t now = (uint32_t)time(NULL);
+
+    // Visited entries, by the bit length of their visit count: bucket b
+    // holds counts below 2^b, so none of them scores above 4 * (2^b - 1).
+    int *bucket[COMPLETE_BUCKETS] = { NULL };
+    int bucket_n[COMPLETE_BUCKETS] = { 0 }, bucket_cap[COMPLETE_BUCKETS] = { 0 };
+    for (int i = 0; i < dir_count; i++)
+    {
+        uint32_t v = dir_visits[i] + dir_peer_visits[i];
+        if (!v)
+            continue;
+        int b = 32 - __builtin_clz(v);
+        if (bucket_n[b] == bucket_cap[b])
+        {
+            bucket_cap[b] = bucket_cap[b] ? bucket_cap[b] * 2 : 64;
+            bucket[b] = xrealloc(bucket[b], (size_t)bucket_cap[b] * sizeof(int));
+        }
+        bucket[b][bucket_n[b]++] = i;
+    }
+
+    // Their names, most visited bucket first, until the rest cannot place.
+    int *indices = NULL;
+    int n = 0, cap = 0;
+    for (int b = COMPLETE_BUCKETS - 1; b > 0; b--)
+    {
+        if (!bucket_n[b])
+            continue;
+        if (n >= limit &&
+            complete_settled(indices, n, limit, 4.0 * (double)((1ull << b) - 1), now))
+            break;
+        for (int k = 0; k < bucket_n[b]; k++)
+        {
+            int i = bucket[b][k];
+            if (!entry_path(i) || strncmp(entry_base(i), prefix, plen) != 0)
+                continue;
+            if (n == cap)
+            {
+                cap = cap ? cap * 2 : 64;
+                indices = xrealloc(indices, (size_t)cap * sizeof(indices[0]));
+            }
+            indices[n++] = i;
+        }
+    }
+    for (int b = 0; b < COMPLETE_BUCKETS; b++)
+        free(bucket[b]);
+
+    struct name_set shown;
+    int count = 0;
+    name_set_init(&shown, (size_t)limit);
+
+    select_top(indices, n, n, now);
+    for (int k = 0; k < n && count < limit; k++)
+    {
+        const char *name = entry_base(indices[k]);
+        if (!strchr(name, '\n') && name_set_add(&shown, name))
+        {
+            printf("%s\n", name);
+            count++;
+        }
+    }
+    free(indices);
+
+    // Then the never-visited ones in entry order, until the limit.
+    for (int i = 0; i < dir_count && count < limit; i++)
+    {
+        if (dir_visits[i] || dir_peer_visits[i] || !entry_path(i))
+            continue;
+        const char *name = entry_base(i);
+        if (strncmp(name, prefix, plen) == 0 && !strchr(name, '\n') &&
+            name_set_add(&shown, name))
+        {
+            printf("%s\n", name);
+            count++;
+        }
+    }
+
+    free(shown.slots);
+    trace_phase(prev);
+    return 0;
+}
+
+/* ---------- Navigation core ---------- */
+
+// The chosen directory is printed for the shell wrapper to cd into, or
+// with nav_target set (the bash builtin), kept there instead.
+static char *nav_target = NULL;
+
+static void emit_target(const char *path)
+{
+    if (!nav_target)
+    {
+        printf("%s\n", path);
+        return;
+    }
+    strncpy(nav_target, path, PATH_MAX);
+    nav_target[PATH_MAX - 1] = '\0';
+}
+
+// Go to the next match of the query segs[0 .. nseg): the best one, or the
+// one after the current directory when it is a match already.
+static int navigate_query(int nseg, char **segs, int from)
+{
+    int *indices;
+    int count = find_query(nseg, segs, &indices);
+
+    if (count == 0)
+    {
+        fprintf(stderr, "xcd-core: no directory matches \"%s\"\n",
+                query_text(nseg, segs));
+        free(indices);
+        return 1;
+    }
+
+    int cur_pos = cycle_position(indices, count, from);
+    int cur = (cur_pos >= 0) ? indices[cur_pos] : -1;
+
+    // Only the chosen target is validated; skip past dead ones.
+    int next = pick_target(indices, &count, cur, (uint32_t)time(NULL));
+    if (next < 0)
+    {
+        fprintf(stderr, "xcd-core: no directory matches \"%s\"\n",
+                query_text(nseg, segs));
+        free(indices);
+        return 1;
+    }
+
+    const char *target = entry_path(indices[next]);
+    free(indices);
+
+    emit_target(target);
+
+    // Stepping from one match to the next is cycling, not a visit.
+    if (cur < 0)
+        record_visit(from);
+    return 0;
+}
+
+// from is the dirs[] index of the directory we are leaving, or -1.
+static int cmd_navigate(int argc, char **argv, int from)
+{
+    const char *home = get_home();
+
+    if (argc == 0)
+    {
+        // No args: go to HOME
+        char canon[PATH_MAX];
+        if (!canonical_path(home, canon, sizeof(canon)))
+        {
+            // fallback: use HOME as-is
+            strncpy(canon, home, sizeof(canon));
+            canon[sizeof(canon) - 1] = '\0';
+        }
+
+        emit_target(canon);
+        if (remember_dir(canon) != from)
+            record_visit(from);
+        return 0;
+    }
+
+    const char *arg = argv[0];
+
+    // If arg is an existing directory (absolute or relative), use it directly
+    if (argc == 1 && is_dir(arg))
+    {
+        char canon[PATH_MAX];
+        if (!canonical_path(arg, canon, sizeof(canon)))
+        {
+            fprintf(stderr, "xcd-core: cannot resolve path: %s\n", arg);
+            return 1;
+        }
+
+        emit_target(canon);
+        if (remember_dir(canon) != from)
+            record_visit(from);
+        return 0;
+    }
+
+    // If arg is relative and does not exist AND has no slash, do fuzzy
+    // search; several slash-free args are one multi-segment query.
+    int simple = 1;
+    for (int k = 0; k < argc; k++)
+        if (strchr(argv[k], '/'))
+            simple = 0;
+
+    if (simple)
+        return navigate_query(argc, argv, from);
+
+    // Otherwise, treat as path that doesn't exist or is invalid
+    fprintf(stderr, "xcd-core: \"%s\" is not a directory and not a simple segment\n", arg);
+    return 1;
+}
+
+// xcd -w [-r] SEG...: navigate_query() within the current project.
+static int cmd_within(int argc, char **argv, int from)
+{
+    int regex = argc > 0 && strcmp(argv[0], "-r") == 0;
+    argc -= regex;
+    argv += regex;
+
+    if (argc == 0)
+    {
+        fprintf(stderr, "xcd-core: -w needs a segment\n");
+        return 1;
+    }
+    for (int k = 0; k < argc && !regex; k++)
+    {
+        if (strchr(argv[k], '/'))
+        {
+            fprintf(stderr, "xcd-core: \"%s\" is not a simple segment\n", argv[k]);
+            return 1;
+        }
+    }
+
+    char root[PATH_MAX];
+    if (!project_root(root, sizeof(root)))
+    {
+        fprintf(stderr, "xcd-core: cannot determine current directory: %s\n",
+                strerror(errno));
+        return 1;
+    }
+
+    query_scope = root;
+    query_regex = regex;
+    int rc = navigate_query(argc, argv, from);
+    query_scope = NULL;
+    query_regex = 0;
+    return rc;
+}
+
+// xcd -r [SEG...] PATTERN: navigate_query() with a regular expression.
+static int cmd_regex(int argc, char **argv, int from)
+{
+    if (argc == 0)
+    {
+        fprintf(stderr, "xcd-core: -r needs a pattern\n");
+        return 1;
+    }
+
+    query_regex = 1;
+    int rc = navigate_query(argc, argv, from);
+    query_regex = 0;
+    return rc;
+}
+
+/* ---------- Interactive picker ---------- */
+
+/* xcd -i [SEG...] shows the matches on the terminal, best first, narrows
+   them as the query is edited, and goes to the highlighted one on Enter.
+   The query reads like the arguments of xcd: blank-separated segments,
+   the last one matching the basename.  Each query typed keeps its match
+   set on a stack.  A query that only lengthens the segments of the one on
+   top (each new segment containing the old one, same count) matches a
+   subset of it, so only that set is filtered, not the whole store; erasing
+   pops back to a set already worked out.  Only the rows whose entry or
+   highlight changed are redrawn, in one write per batch of keystrokes. */
+
+#define PICK_QUERY_MAX    256
+#define PICK_SEGMENTS     16
+#define PICK_DEPTH_MAX    64
+#define PICK_ROWS_MAX     100
+#define PICK_ESC_TIMEOUT  25   // ms to wait for the rest of an escape sequence
+
+struct pick_level
+{
+    char query[PICK_QUERY_MAX];  // segments joined by single blanks
+    int *indices;
+    int count;
+    int refinable;               // substring matches, so a subset can narrow them
+    int fuzzy;                   // approximate matches (no exact one)
+    int ranked;                  // rows at the front known to be the best
+};
+
+struct picker
+{
+    struct pick_level levels[PICK_DEPTH_MAX];
+    int depth;
+    int rows;                    // rows wanted at the front of the top level
+    uint32_t now;
+};
+
+// Split text at blanks into segs; returns how many.
+static int picker_split(char *text, char **segs)
+{
+    int nseg = 0;
+    char *save;
+
+    for (char *tok = strtok_r(text, " \t", &save);
+         tok && nseg < PICK_SEGMENTS; tok = strtok_r(NULL, " \t", &save))
+        segs[nseg++] = tok;
+    return nseg;
+}
+
+// Does the query segs[0 .. nseg) match a subset of what level matched?
+static int picker_refines(const struct pick_level *level, char **segs, int nseg)
+{
+    char old[PICK_QUERY_MAX];
+    char *old_segs[PICK_SEGMENTS];
+
+    if (!level->refinable || nseg == 0 || is_glob(segs[nseg - 1]))
+        return 0;
+
+    // Everything matches the empty query, but past two bytes the trigram
+    // index finds a segment faster than filtering everything.
+    if (level->query[0] == '\0')
+        return nseg == 1 && strlen(segs[0]) < 3;
+
+    memcpy(old, level->query, sizeof(old));
+    if (picker_split(old, old_segs) != nseg)
+        return 0;
+    for (int k = 0; k < nseg; k++)
+        if (!strstr(segs[k], old_segs[k]))
+            return 0;
+    return 1;
+}
+
+static void picker_init(struct picker *pk)
+{
+    struct pick_level *all = &pk->levels[0];
+    int cap = 64;
+
+    memset(pk, 0, sizeof(*pk));
+    pk->depth = 1;
+    pk->rows = 1;
+    pk->now = (uint32_t)time(NULL);
+
+    // the empty query: everything
+    all->refinable = 1;
+    all->indices = xrealloc(NULL, (size_t)cap * sizeof(all->indices[0]));
+    for (int i = 0; i < dir_count; i++)
+        if (entry_path(i))
+            push_match(&all->indices, &all->count, &cap, i);
+}
+
+static void picker_free(struct picker *pk)
+{
+    for (int d = 0; d < pk->depth; d++)
+        free(pk->levels[d].indices);
+    pk->depth = 0;
+}
+
+// Make the match set of text the top level.
+static void picker_query(struct picker *pk, const char *text)
+{
+    char buf[PICK_QUERY_MAX];
+    char *segs[PICK_SEGMENTS];
+    snprintf(buf, sizeof(buf), "%s", text);
+    int nseg = picker_split(buf, segs);
+
+    struct pick_level next;
+    next.query[0] = '\0';
+    for (int k = 0; k < nseg; k++)
+    {
+        size_t len = strlen(next.query);
+        snprintf(next.query + len, sizeof(next.query) - len, "%s%s",
+                 k ? " " : "", segs[k]);
+    }
+
+    // Back down to the query this one equals or narrows; the bottom one,
+    // the empty query, always stays.
+    struct pick_level *top = &pk->levels[pk->depth - 1];
+    while (pk->depth > 1 && strcmp(top->query, next.query) != 0 &&
+           !picker_refines(top, segs, nseg))
+    {
+        free(top->indices);
+        top = &pk->levels[--pk->depth - 1];
+    }
+    if (strcmp(top->query, next.query) == 0)
+        return;
+
+    int prev = trace_phase(PHASE_MATCH);
+    next.count = 0;
+    next.indices = NULL;
+    if (picker_refines(top, segs, nseg))
+    {
+        const char *last = segs[nseg - 1];
+        next.indices = xrealloc(NULL, (size_t)(top->count + 1) * sizeof(next.indices[0]));
+        for (int i = 0; i < top->count; i++)
+        {
+            int e = top->indices[i];
+            if (entry_live(e) && strstr(entry_base(e), last) &&
+                (nseg == 1 || ancestors_match(entry_path(e), nseg - 1, segs)))
+                next.indices[next.count++] = e;
+        }
+        next.refinable = 1;
+        next.fuzzy = 0;
+    }
+
+    // Nothing left may still mean approximate matches, as for xcd SEG.
+    if (next.count == 0)
+    {
+        free(next.indices);
+        next.count = find_query(nseg, segs, &next.indices);
+        next.refinable = !query_fuzzy && !is_glob(segs[nseg - 1]);
+        next.fuzzy = query_fuzzy;
+    }
+    trace_phase(prev);
+    next.ranked = 0;
+
+    // too deep: the new level takes the place of the top one
+    if (pk->depth == PICK_DEPTH_MAX)
+        free(pk->levels[--pk->depth].indices);
+    pk->levels[pk->depth++] = next;
+}
+
+// Put the best pk->rows matches of the top level at its front, best
+// first, dropping dead ones among them; returns how many there are.
+static int picker_rows(struct picker *pk)
+{
+    struct pick_level *top = &pk->levels[pk->depth - 1];
+
+    for (;;)
+    {
+        int rows = (top->count < pk->rows) ? top->count : pk->rows;
+        if (top->ranked < rows)
+            select_top(top->indices, top->count, rows, pk->now);
+        top->ranked = rows;
+
+        int dead = 0;
+        for (int i = 0; i < rows; )
+        {
+            int e = top->indices[i];
+            if (entry_path(e) && check_dir(e))
+            {
+                i++;
+            }
+            else
+            {
+                unlink_match(top->indices, &top->count, i);
+                rows--;
+                dead = 1;
+            }
+        }
+        if (!dead)
+            return rows;
+        top->ranked = 0; // refill from the rest
+    }
+}
+
+/* The screen, on the terminal's alternate buffer: the query on row 1,
+   the match count on row 2, the matches below. */
+
+struct pick_screen
+{
+    FILE *out;
+    int width;
+    int rows;                    // match rows that fit
+    int drawn[PICK_ROWS_MAX];    // entry shown on each row, -1 for none
+    int drawn_sel;               // highlighted row
+};
+
+static volatile sig_atomic_t picker_resized = 0;
+
+static void picker_winch(int sig)
+{
+    (void)sig;
+    picker_resized = 1;
+}
+
+// Take the terminal size, and forget what is on screen.
+static void picker_resize(struct pick_screen *scr, int fd)
+{
+    struct winsize ws;
+    int height = 24;
+
+    scr->width = 80;
+    if (ioctl(fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0)
+    {
+        scr->width = ws.ws_col;
+        height = ws.ws_row;
+    }
+    scr->rows = height - 2;
+    if (scr->rows < 1)
+        scr->rows = 1;
+    if (scr->rows > PICK_ROWS_MAX)
+        scr->rows = PICK_ROWS_MAX;
+
+    for (int r = 0; r < PICK_ROWS_MAX; r++)
+        scr->drawn[r] = -2;
+    scr->drawn_sel = -1;
+    fputs("\033[H\033[2J", scr->out);
+}
+
+static void picker_draw(struct pick_screen *scr, const char *query,
+                        const struct pick_level *top, int rows, int total,
+                        int sel)
+{
+    FILE *out = scr->out;
+    int avail = scr->width - 2;
+
+    for (int r = 0; r < scr->rows; r++)
+    {
+        int e = (r < rows) ? top->indices[r] : -1;
+        int hl = (r == sel && e >= 0);
+        if (e == scr->drawn[r] && hl == (r == scr->drawn_sel))
+            continue;
+        scr->drawn[r] = e;
+
+        fprintf(out, "\033[%d;1H", r + 3);
+        if (e >= 0)
+        {
+            // long paths keep their tail, which tells them apart
+            const char *path = entry_path(e);
+            size_t len = strlen(path);
+            const char *cut = "";
+            if (avail > 3 && len > (size_t)avail)
+            {
+                path += len - (size_t)(avail - 3);
+                while ((*path & 0xC0) == 0x80)
+                    path++;
+                cut = "...";
+            }
+            fprintf(out, "%s%s%s\033[0m", hl ? "\033[7m> " : "  ", cut, path);
+        }
+        fputs("\033[K", out);
+    }
+    scr->drawn_sel = (sel < rows) ? sel : -1;
+
+    fprintf(out, "\033[2;1H  %d/%d%s\033[K", top->count, total,
+            top->fuzzy ? " (approximate)" : "");
+    fprintf(out, "\033[1;1H> %s\033[K", query);
+    fflush(out);
+}
+
+// Wait up to ms for input on fd.
+static int picker_input(int fd, int ms)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    return poll(&pfd, 1, ms) > 0;
+}
+
+// xcd -i [SEG...]: pick a match on the terminal and go there.
+static int cmd_pick(int argc, char **argv, int from)
+{
+    int fd = open("/dev/tty", O_RDWR | O_CLOEXEC);
+    struct termios saved;
+    if (fd < 0 || tcgetattr(fd, &saved) != 0)
+    {
+        fprintf(stderr, "xcd-core: -i needs a terminal\n");
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+
+    struct pick_screen scr;
+    scr.out = fdopen(dup(fd), "w");
+    if (!scr.out)
+    {
+        fprintf(stderr, "xcd-core: cannot write to the terminal: %s\n",
+                strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    struct termios raw = saved;
+    raw.c_iflag &= ~(tcflag_t)(ICRNL | IXON);
+    raw.c_lflag &= ~(tcflag_t)(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSAFLUSH, &raw);
+
+    struct sigaction sa, old_winch;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = picker_winch; // no SA_RESTART, so read() wakes up
+    sigaction(SIGWINCH, &sa, &old_winch);
+
+    fputs("\033[?1049h", scr.out);
+    picker_resize(&scr, fd);
+    picker_resized = 0;
+
+    char query[PICK_QUERY_MAX];
+    snprintf(query, sizeof(query), "%s", query_text(argc, argv));
+    size_t len = strlen(query);
+
+    struct picker *pk = xrealloc(NULL, sizeof(*pk));
+    picker_init(pk);
+    int total = pk->levels[0].count;
+
+    int sel = 0;
+    int rows = 0;
+    int done = 0;   // 1 to go to the highlighted match, -1 to give up
+
+    while (done >= 0)
+    {
+        if (picker_resized)
+        {
+            picker_resized = 0;
+            picker_resize(&scr, fd);
+        }
+
+        pk->rows = scr.rows;
+        picker_query(pk, query);
+        rows = picker_rows(pk);
+        if (sel >= rows)
+            sel = rows - 1;
+        if (sel < 0)
+            sel = 0;
+        if (done > 0)
+        {
+            if (rows > 0)
+                break;
+            done = 0; // Enter with nothing to pick
+        }
+
+        picker_draw(&scr, query, &pk->levels[pk->depth - 1], rows, total, sel);
+
+        // Everything typed meanwhile is handled before the next redraw.
+        unsigned char keys[256];
+        ssize_t n = read(fd, keys, sizeof(keys));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            done = -1;
+            break;
+        }
+        while ((size_t)n < sizeof(keys) && picker_input(fd, 0))
+        {
+            ssize_t more = read(fd, keys + n, sizeof(keys) - (size_t)n);
+            if (more <= 0)
+                break;
+            n += more;
+        }
+
+        for (ssize_t i = 0; i < n && !done; i++)
+        {
+            int c = keys[i];
+
+            if (c == 27)
+            {
+                // a lone Esc cancels; arrows come as ESC [ A or ESC O A
+                if (i + 1 == n && (size_t)n < sizeof(keys) &&
+                    picker_input(fd, PICK_ESC_TIMEOUT))
+                {
+                    ssize_t more = read(fd, keys + n, sizeof(keys) - (size_t)n);
+                    if (more > 0)
+                        n += more;
+                }
+                if (i + 1 == n)
+                {
+                    done = -1;
+                }
+                else if (keys[i + 1] == '[' || keys[i + 1] == 'O')
+                {
+                    ssize_t j = i + 2;
+                    while (j < n && (keys[j] < 0x40 || keys[j] > 0x7e))
+                        j++;
+                    if (j < n && keys[j] == 'A')
+                        sel--;
+                    else if (j < n && keys[j] == 'B')
+                        sel++;
+                    i = j;
+                }
+                else
+                {
+                    i++; // Alt+key: ignored
+                }
+            }
+            else if (c == '\r' || c == '\n')
+                done = 1;
+            else if (c == 3 || c == 7)          // Ctrl-C, Ctrl-G
+                done = -1;
+            else if (c == 16)                   // Ctrl-P
+                sel--;
+            else if (c == 14)                   // Ctrl-N
+                sel++;
+            else if (c == 127 || c == 8)        // Backspace: one character
+            {
+                while (len > 0 && (query[--len] & 0xC0) == 0x80)
+                    ;
+                query[len] = '\0';
+                sel = 0;
+            }
+            else if (c == 23)                   // Ctrl-W: one word
+            {
+                while (len > 0 && query[len - 1] == ' ')
+                    len--;
+                while (len > 0 && query[len - 1] != ' ')
+                    len--;
+                query[len] = '\0';
+                sel = 0;
+            }
+            else if (c == 21)                   // Ctrl-U: all of it
+            {
+                len = 0;
+                query[0] = '\0';
+                sel = 0;
+            }
+            else if ((c >= 32 || c == '\t') && len < sizeof(query) - 1)
+            {
+                query[len++] = (c == '\t') ? ' ' : (char)c;
+                query[len] = '\0';
+                sel = 0;
+            }
+        }
+        if (sel < 0)
+            sel = 0;
+    }
+
+    fputs("\033[?1049l", scr.out);
+    fflush(scr.out);
+    fclose(scr.out);
+    tcsetattr(fd, TCSAFLUSH, &saved);
+    sigaction(SIGWINCH, &old_winch, NULL);
+    close(fd);
+
+    int rc = 1;
+    if (done > 0)
+    {
+        int target = pk->levels[pk->depth - 1].indices[sel];
+        emit_target(entry_path(target));
+        if (target != from)
+            record_visit(from);
+        rc = 0;
+    }
+
+    picker_free(pk);
+    free(pk);
+    return rc;
+}
+
+/* ---------- Command dispatch ---------- */
+
+// Run one invocation against the loaded memory.  Saving is left to the
+// caller: main() saves right away, the server in batches.
+static int run_command(int argc, char **argv)
+{
+    /* Management / info commands do NOT change dirs, and we won't
+       add the current dir for those (so 'xcd-core -c' really clears). */
+
+    if (argc >= 2)
+    {
+        const char *arg1 = argv[1];
+
+        if (strcmp(arg1, "-h") == 0 || strcmp(arg1, "--help") == 0)
+        {
+            cmd_help();
+            return 0;
+        }
+
+        if (strcmp(arg1, "-c") == 0)
+        {
+            cmd_clear();
+            return 0;
+        }
+
+        if (strcmp(arg1, "-l") == 0)
+        {
+            // dead entries found while listing are persisted by the caller
+            query_regex = argc > 3 && strcmp(argv[2], "-r") == 0;
+            cmd_list(argc - 2 - query_regex, &argv[2 + query_regex]);
+            query_regex = 0;
+            return 0;
+        }
+
+        if (strcmp(arg1, "-p") == 0)
+        {
+            query_regex = argc > 3 && strcmp(argv[2], "-r") == 0;
+            cmd_preview(argc - 2 - query_regex, &argv[2 + query_regex]);
+            query_regex = 0;
+            return 0;
+        }
+
+        if (strcmp(arg1, "-x") == 0)
+        {
+            cmd_index();
+            return 0;
+        }
+
+        if (strcmp(arg1, "-g") == 0)
+            return cmd_gc(argc - 2, &argv[2]);
+
+        if (strcmp(arg1, "-s") == 0)
+            return cmd_seed(argc - 2, &argv[2]);
+
+        if (strcmp(arg1, "--complete") == 0)
+            return cmd_complete(argc - 2, &argv[2]);
+
+        if (strcmp(arg1, "--stats") == 0)
+        {
+            cmd_stats();
+            return 0;
+        }
+    }
+
+    /* Navigation mode:
+       - First remember the directory we are currently in
+       - Then compute the target directory and remember that too
+    */
+    int from = remember_dir(".");
+
+    if (argc >= 2 && strcmp(argv[1], "-w") == 0)
+        return cmd_within(argc - 2, &argv[2], from);
+
+    if (argc >= 2 && strcmp(argv[1], "-r") == 0)
+        return cmd_regex(argc - 2, &argv[2], from);
+
+    if (argc >= 2 && strcmp(argv[1], "-i") == 0)
+        return cmd_pick(argc - 2, &argv[2], from);
+
+    if (argc == 1)
+    {
+        // No args: go to HOME
+        return cmd_navigate(0, NULL, from);
     }
 
-    fclose(f);
+    return cmd_navigate(argc - 1, &argv[1], from);
 }
 
-static void save_memory()
+/* ---------- Batch queries ---------- */
+
+/* xcd-core --batch answers many xcd-core -l queries from one load.  Each
+   line of stdin (each NUL-terminated record with -0) is a query: what
+   would follow -l, segments separated by blanks.  Each answer is a frame:
+   the matching directories one per line, then an empty line (with -0,
+   NUL-terminated, then an empty record); paths are never empty, so the
+   empty one ends the frame, and a blank query gets an empty frame.
+   Answers are buffered and flushed whenever the queries read so far are
+   used up, so one write of many queries gets one write back, and a
+   coprocess sending one query at a time still gets each answer at once. */
+
+#define BATCH_SEGMENTS 64
+#define BATCH_READ     (64 * 1024)
+
+static void batch_query(char *query)
 {
-    if (!memory_dirty)
-        return;
+    char *segs[BATCH_SEGMENTS];
+    int nseg = 0;
+    char *save;
 
-    FILE *f = fopen(memory_file, "w");
-    if (!f)
+    for (char *tok = strtok_r(query, " \t\r", &save);
+         tok && nseg < BATCH_SEGMENTS; tok = strtok_r(NULL, " \t\r", &save))
+        segs[nseg++] = tok;
+
+    if (nseg > 0)
     {
-        fprintf(stderr, "xcd-core: cannot write %s: %s\n",
-                memory_file, strerror(errno));
-        return;
+        query_regex = nseg > 1 && strcmp(segs[0], "-r") == 0;
+        cmd_list(nseg - query_regex, &segs[query_regex]);
+        query_regex = 0;
     }
-
-    for (int i = 0; i < dir_count; i++)
-        fprintf(f, "%s\n", dirs[i]);
-
-    fclose(f);
-    memory_dirty = 0;
+    putchar(list_sep);
 }
 
-static void remember_dir(const char *path)
+static int cmd_batch(int argc, char **argv)
 {
-    if (!is_dir(path))
-        return;
+    static char out[BATCH_READ];
+    char sep = '\n';
 
-    char canon[PATH_MAX];
-    if (!canonical_path(path, canon, sizeof(canon)))
-        return;
+    if (argc == 1 && strcmp(argv[0], "-0") == 0)
+        sep = '\0';
+    else if (argc > 0)
+    {
+        fprintf(stderr, "xcd-core: usage: xcd-core --batch [-0]\n");
+        return 1;
+    }
 
-    if (contains_dir(canon))
-        return;
+    setvbuf(stdout, out, _IOFBF, sizeof(out));
+    list_sep = sep;
 
-    if (dir_count >= MAX_DIRS)
-        return;
+    char *buf = NULL;
+    size_t cap = 0, len = 0;
+    int eof = 0;
 
-    dirs[dir_count] = strdup(canon);
-    if (!dirs[dir_count])
+    while (!eof)
     {
-        fprintf(stderr, "xcd-core: out of memory\n");
-        exit(1);
+        if (cap - len < BATCH_READ)
+        {
+            cap = cap ? cap * 2 : 2 * BATCH_READ;
+            buf = xrealloc(buf, cap);
+        }
+
+        ssize_t n = read(STDIN_FILENO, buf + len, cap - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            // a last query without its terminator still counts
+            eof = 1;
+            if (len > 0)
+                buf[len++] = sep;
+        }
+        else
+            len += (size_t)n;
+
+        char *p = buf;
+        char *end = memchr(p, sep, len);
+        if (end)
+            refresh_memory(); // visits other processes made meanwhile
+        for (; end; end = memchr(p, sep, len - (size_t)(p - buf)))
+        {
+            *end = '\0';
+            batch_query(p);
+            p = end + 1;
+        }
+        len -= (size_t)(p - buf);
+        memmove(buf, p, len);
+
+        if (fflush(stdout) != 0)
+            break; // reader gone
     }
 
-    dir_count++;
-    memory_dirty = 1;
+    free(buf);
+    list_sep = '\n';
+    return ferror(stdout) ? 1 : 0;
 }
 
-/* ---------- Commands ---------- */
+/* ---------- Server ---------- */
 
-static void cmd_help()
+/* xcd-core --serve keeps the memory loaded and answers xcd-core --client
+   over a Unix socket, so a navigation costs a connect() instead of a
+   load and a save.  A request is the client's cwd, HOME and arguments,
+   NUL-separated; the client's stdout and stderr travel with it, so
+   commands print straight to the caller, and the reply is one byte of
+   exit status.  Changes are written in batches: SERVE_FLUSH_SECS after
+   the first one, sooner once SERVE_FLUSH_BATCH records are pending, and
+   on exit.  Before each request the journal is checked for records other
+   processes appended, so one-shot runs alongside the server are merged.
+   Requests are served one at a time, so a client that has not sent all
+   of its request within SERVE_READ_MS (stopped with ^Z, say) is declined
+   rather than waited for; it runs the command itself once it resumes. */
+
+#define SERVE_FLUSH_SECS  5
+#define SERVE_FLUSH_BATCH 64
+#define SERVE_REQUEST_MAX (64 * 1024)
+#define SERVE_READ_MS     250
+#define SERVE_DECLINED    255  // reply: run the command yourself
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_signal(int sig)
 {
-    printf(
-        "xcd-core - core logic for xcd (Linux/macOS)\n\n"
-        "Usage (called via shell wrapper):\n"
-        "  xcd                 Print canonical HOME directory.\n"
-        "  xcd DIR             Print canonical DIR if it exists.\n"
-        "  xcd SEGMENT         Fuzzy match remembered dirs by basename and\n"
-        "                           print the chosen target directory.\n"
-        "\n"
-        "Options (management / info; do NOT change directory):\n"
-        "  xcd -h              Show this help.\n"
-        "  xcd -l              List all remembered directories.\n"
-        "  xcd -l SEGMENT      List remembered dirs whose basename contains SEGMENT.\n"
-        "  xcd -p SEGMENT      Preview matches and which one would be used next.\n"
-        "  xcd -c              Clear the memory file (~/.xcd_memory).\n"
-        "\n"
-        "Note: wrappers should only 'cd' into the directory printed when\n"
-        "no -h/-l/-p/-c option is used.\n"
-    );
+    (void)sig;
+    serve_stop = 1;
 }
 
-static void cmd_clear()
+// $XDG_RUNTIME_DIR/xcd-core.sock, or a per-user name in /tmp.
+static int socket_address(struct sockaddr_un *addr)
 {
-    // Clear in-memory list and truncate file
-    free_memory_list();
-    FILE *f = fopen(memory_file, "w");
-    if (f)
-        fclose(f);
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    int n;
+    if (dir && *dir)
+        n = snprintf(addr->sun_path, sizeof(addr->sun_path),
+                     "%s/xcd-core.sock", dir);
+    else
+        n = snprintf(addr->sun_path, sizeof(addr->sun_path),
+                     "/tmp/xcd-core-%ld.sock", (long)getuid());
+
+    return n > 0 && (size_t)n < sizeof(addr->sun_path);
+}
+
+// Is the other end of fd running as us?
+static int peer_is_self(int fd)
+{
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return 0;
+    return cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) != 0)
+        return 0;
+    return uid == getuid();
+#endif
 }
 
-static void cmd_list(const char *segment)
+static void serve_request(int conn, int out_fd, int err_fd)
 {
-    if (!segment || segment[0] == '\0')
+    char *buf = xrealloc(NULL, SERVE_REQUEST_MAX);
+    size_t len = 0;
+    int fds[2] = { -1, -1 };
+    int complete = 0;  // the client's EOF arrived in time
+
+    // No single read may wait longer than what is left of the deadline.
+    double deadline = clock_ms() + SERVE_READ_MS;
+    struct timeval tv = { 0, SERVE_READ_MS * 1000 };
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // The first read carries the client's stdout and stderr.
+    union
     {
-        // list all
-        for (int i = 0; i < dir_count; i++)
-            printf("%s\n", dirs[i]);
-    }
-    else
+        struct cmsghdr hdr;
+        char space[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+    struct iovec iov = { buf, SERVE_REQUEST_MAX };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.space;
+    msg.msg_controllen = sizeof(ctl.space);
+
+    ssize_t n = recvmsg(conn, &msg, 0);
+    if (n > 0)
     {
-        for (int i = 0; i < dir_count; i++)
+        len = (size_t)n;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
         {
-            const char *base = strrchr(dirs[i], '/');
-            if (!base)
-                base = dirs[i];
-            else
-                base++; // skip '/'
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS &&
+                c->cmsg_len == CMSG_LEN(sizeof(fds)))
+                memcpy(fds, CMSG_DATA(c), sizeof(fds));
+        }
+        while (len < SERVE_REQUEST_MAX)
+        {
+            double left = deadline - clock_ms();
+            if (left <= 0)
+                break;
+            tv.tv_sec = 0;
+            tv.tv_usec = (long)(left * 1000) + 1;
+            setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-            if (strstr(base, segment))
-                printf("%s\n", dirs[i]);
+            n = read(conn, buf + len, SERVE_REQUEST_MAX - len);
+            if (n == 0)
+                complete = 1;
+            if (n <= 0)
+                break;
+            len += (size_t)n;
         }
     }
-}
-
-static int find_matches(const char *segment, int *out_indices, int max_indices)
-{
-    int count = 0;
 
-    for (int i = 0; i < dir_count; i++)
+    // Split into cwd, HOME and the arguments.
+    char *argv[256];
+    int argc = 0;
+    argv[argc++] = "xcd-core";
+    char *cwd = NULL, *home = NULL;
+    for (size_t p = 0; p < len && argc < 255; )
     {
-        const char *base = strrchr(dirs[i], '/');
-        if (!base)
-            base = dirs[i];
+        char *s = buf + p;
+        char *end = memchr(s, '\0', len - p);
+        if (!end)
+            break;
+        if (!cwd)
+            cwd = s;
+        else if (!home)
+            home = s;
         else
-            base++;
+            argv[argc++] = s;
+        p = (size_t)(end - buf) + 1;
+    }
+    argv[argc] = NULL;
+
+    // The picker needs the client's terminal, and --batch its stdin.  A gc,
+    // crawl or index build can take seconds, and one client must not hold
+    // up every other shell for that long: the client runs those itself.
+    const char *cmd = (argc >= 3 && strcmp(argv[1], "--trace") == 0) ? argv[2]
+                      : (argc >= 2) ? argv[1] : "";
+    int local = strcmp(cmd, "-i") == 0 || strcmp(cmd, "--batch") == 0 ||
+                strcmp(cmd, "-g") == 0 || strcmp(cmd, "-s") == 0 ||
+                strcmp(cmd, "-x") == 0;
+
+    unsigned char rc = SERVE_DECLINED;
+    if (complete && !local && fds[0] >= 0 && fds[1] >= 0 && home &&
+        strcmp(home, get_home()) == 0 && chdir(cwd) == 0)
+    {
+        fflush(stdout);
+        fflush(stderr);
+        dup2(fds[0], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+
+        // "load" is the refresh; saving happens later, in batches
+        trace_begin(&argc, argv);
+        refresh_memory();
+        trace_phase(PHASE_COMMAND);
+        rc = (unsigned char)run_command(argc, argv);
+        trace_end(argc, argv);
 
-        if (strstr(base, segment))
+        fflush(stdout);
+        fflush(stderr);
+        clearerr(stdout);
+        clearerr(stderr);
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(err_fd, STDERR_FILENO);
+
+        if (chdir("/") != 0)
         {
-            if (count < max_indices)
-                out_indices[count] = i;
-            count++;
+            // harmless: it only keeps the client's directory busy
         }
     }
 
-    return count;
+    if (write(conn, &rc, 1) != 1)
+    {
+        // client gone; its output already went where it asked
+    }
+
+    if (fds[0] >= 0)
+        close(fds[0]);
+    if (fds[1] >= 0)
+        close(fds[1]);
+    free(buf);
 }
 
-static void cmd_preview(const char *segment)
+static int cmd_serve()
 {
-    if (!segment || segment[0] == '\0')
+    struct sockaddr_un addr;
+    if (!socket_address(&addr))
     {
-        fprintf(stderr, "xcd-core: -p requires a segment\n");
-        return;
+        fprintf(stderr, "xcd-core: socket path too long\n");
+        return 1;
     }
 
-    int indices[MAX_DIRS];
-    int count = find_matches(segment, indices, MAX_DIRS);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "xcd-core: cannot create socket: %s\n", strerror(errno));
+        return 1;
+    }
 
-    if (count == 0)
+    // Something answering there already is a live server; anything else
+    // is a stale socket from one that died.
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
     {
-        printf("No matches for \"%s\".\n", segment);
-        return;
+        fprintf(stderr, "xcd-core: already serving on %s\n", addr.sun_path);
+        close(fd);
+        return 1;
     }
+    close(fd);
+    unlink(addr.sun_path);
 
-    char cwd[PATH_MAX];
-    if (!canonical_path(".", cwd, sizeof(cwd)))
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t old_mask = umask(077);
+    int ok = fd >= 0 &&
+             bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+             listen(fd, 16) == 0;
+    umask(old_mask);
+    if (!ok)
     {
-        fprintf(stderr, "xcd-core: cannot determine current directory\n");
-        return;
+        fprintf(stderr, "xcd-core: cannot listen on %s: %s\n",
+                addr.sun_path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 1;
     }
 
-    int cur_idx = -1;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_signal; // no SA_RESTART, so poll() wakes up
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
-    for (int i = 0; i < count; i++)
+    int out_fd = dup(STDOUT_FILENO);
+    int err_fd = dup(STDERR_FILENO);
+    time_t flush_at = 0;
+    index_inline = 1; // no one waits on our flushes
+
+    while (!serve_stop)
     {
-        if (strcmp(dirs[indices[i]], cwd) == 0)
+        int timeout = -1;
+        if (flush_at)
         {
-            cur_idx = i;
-            break;
+            time_t now = time(NULL);
+            timeout = (flush_at > now) ? (int)(flush_at - now) * 1000 : 0;
         }
-    }
 
-    int next = (cur_idx < 0) ? 0 : (cur_idx + 1) % count;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int r = poll(&pfd, 1, timeout);
+        if (r < 0 && errno != EINTR)
+            break;
 
-    printf("Matches for \"%s\":\n", segment);
-    for (int i = 0; i < count; i++)
-    {
-        const char *mark = (i == cur_idx) ? "*" : " ";
-        printf("  [%d]%s %s\n", i, mark, dirs[indices[i]]);
-    }
+        if (r > 0)
+        {
+            int conn = accept(fd, NULL, NULL);
+            if (conn >= 0)
+            {
+                if (peer_is_self(conn))
+                    serve_request(conn, out_fd, err_fd);
+                close(conn);
+            }
+        }
 
-    if (cur_idx >= 0)
-        printf("Current directory is at index [%d].\n", cur_idx);
-    else
-        printf("Current directory is not in the match list.\n");
+        if (memory_dirty || index_dirty)
+        {
+            int pending = visit_log_count + (dir_count - saved_count);
+            if (!flush_at)
+                flush_at = time(NULL) + SERVE_FLUSH_SECS;
+            if (pending >= SERVE_FLUSH_BATCH || time(NULL) >= flush_at)
+            {
+                flush_memory();
+                flush_at = 0;
+            }
+        }
+        else
+        {
+            flush_at = 0;
+        }
+    }
 
-    printf("Next target for segment \"%s\": [%d] %s\n",
-           segment, next, dirs[indices[next]]);
+    flush_memory();
+    close(fd);
+    unlink(addr.sun_path);
+    return 0;
 }
 
-/* ---------- Navigation core ---------- */
-
-static int cmd_navigate(int argc, char **argv)
+// Hand the invocation to a running server.  Returns its exit status, or
+// -1 when there is none (or it declined) and we should do the work here.
+static int serve_client(int argc, char **argv)
 {
-    const char *home = get_home();
+    struct sockaddr_un addr;
+    char cwd[PATH_MAX];
+    if (!socket_address(&addr) || !getcwd(cwd, sizeof(cwd)))
+        return -1;
 
-    if (argc == 0)
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        !peer_is_self(fd))
     {
-        // No args: go to HOME
-        char canon[PATH_MAX];
-        if (!canonical_path(home, canon, sizeof(canon)))
-        {
-            // fallback: use HOME as-is
-            strncpy(canon, home, sizeof(canon));
-            canon[sizeof(canon) - 1] = '\0';
-        }
+        close(fd);
+        return -1;
+    }
 
-        printf("%s\n", canon);
-        remember_dir(canon);
-        return 0;
+    const char *home = get_home();
+    size_t len = strlen(cwd) + strlen(home) + 2;
+    for (int i = 1; i < argc; i++)
+        len += strlen(argv[i]) + 1;
+    if (len > SERVE_REQUEST_MAX || argc > 250)
+    {
+        close(fd);
+        return -1;
     }
 
-    const char *arg = argv[0];
+    char *buf = xrealloc(NULL, len);
+    char *p = buf;
+    p = stpcpy(p, cwd) + 1;
+    p = stpcpy(p, home) + 1;
+    for (int i = 1; i < argc; i++)
+        p = stpcpy(p, argv[i]) + 1;
 
-    // If arg is an existing directory (absolute or relative), use it directly
-    if (is_dir(arg))
+    int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    union
     {
-        char canon[PATH_MAX];
-        if (!canonical_path(arg, canon, sizeof(canon)))
-        {
-            fprintf(stderr, "xcd-core: cannot resolve path: %s\n", arg);
-            return 1;
-        }
+        struct cmsghdr hdr;
+        char space[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.space;
+    msg.msg_controllen = sizeof(ctl.space);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
 
-        printf("%s\n", canon);
-        remember_dir(canon);
-        return 0;
+    signal(SIGPIPE, SIG_IGN);
+    ssize_t n = sendmsg(fd, &msg, 0);
+    size_t sent = (n > 0) ? (size_t)n : 0;
+    while (n > 0 && sent < len && (n = write(fd, buf + sent, len - sent)) > 0)
+        sent += (size_t)n;
+    free(buf);
+
+    if (sent < len)
+    {
+        close(fd);
+        return -1;
     }
+    shutdown(fd, SHUT_WR);
+
+    unsigned char rc;
+    n = read(fd, &rc, 1);
+    close(fd);
 
-    // If arg is relative and does not exist AND has no slash, do fuzzy search
-    if (strchr(arg, '/') == NULL)
+    if (n != 1)
     {
-        int indices[MAX_DIRS];
-        int count = find_matches(arg, indices, MAX_DIRS);
+        // It may have run part of the command; doing it again could cd twice.
+        fprintf(stderr, "xcd-core: server went away\n");
+        return 1;
+    }
+    return (rc == SERVE_DECLINED) ? -1 : rc;
+}
 
-        if (count == 0)
-        {
-            fprintf(stderr, "xcd-core: no directory matches \"%s\"\n", arg);
-            return 1;
-        }
+/* ---------- Bash builtin ---------- */
 
-        char cwd[PATH_MAX];
-        if (!canonical_path(".", cwd, sizeof(cwd)))
-        {
-            fprintf(stderr, "xcd-core: cannot determine current directory\n");
-            return 1;
-        }
+/* Built with -DXCD_BUILTIN (see the README) this file is a bash loadable
+   builtin: "enable -f xcd.so xcd" replaces the xcd() wrapper function.
+   The memory is loaded on first use and kept for the life of the shell;
+   each call picks up what other shells appended, cds in-process through
+   bash's own cd, and flushes its changes like the server does.  No fork,
+   no exec, no command substitution. */
 
-        int cur_idx = -1;
+#ifdef XCD_BUILTIN
 
-        for (int i = 0; i < count; i++)
-        {
-            if (strcmp(dirs[indices[i]], cwd) == 0)
-            {
-                cur_idx = i;
-                break;
-            }
-        }
+static int builtin_loaded = 0;
 
-        int next = (cur_idx < 0) ? 0 : (cur_idx + 1) % count;
-        const char *target = dirs[indices[next]];
+// Forget the loaded memory after a call gave up halfway, so the next call
+// starts over from what is on disk.
+static void builtin_discard()
+{
+    free_memory_list();
+    if (index_map)
+        munmap(index_map, index_map_len);
+    index_map = NULL;
+    index_map_len = 0;
+    memory_dirty = 0;
+    index_dirty = 0;
+    compact_needed = 0;
+    journal_records = 0;
+    builtin_loaded = 0;
+}
 
-        printf("%s\n", target);
-        remember_dir(target); // may already be present; harmless
-        return 0;
+// cd through bash's own builtin, so PWD, OLDPWD and `cd -` stay right.
+static int builtin_cd(const char *target)
+{
+    // Map the canonical physical home back to $HOME, as xcd.sh does, so
+    // PWD stays under $HOME and the prompt shows ~.
+    char path[PATH_MAX * 2];
+    char physical_home[PATH_MAX];
+    const char *home = get_home();
+    size_t n = 0;
+    if (canonical_path(home, physical_home, sizeof(physical_home)))
+        n = strlen(physical_home);
+
+    if (n > 0 && strncmp(target, physical_home, n) == 0 &&
+        (target[n] == '\0' || target[n] == '/'))
+        snprintf(path, sizeof(path), "%s%s", home, target + n);
+    else
+        snprintf(path, sizeof(path), "%s", target);
+
+    sh_builtin_func_t *cd = builtin_address("cd");
+    if (!cd)
+    {
+        builtin_error("cd builtin not found");
+        return EXECUTION_FAILURE;
     }
 
-    // Otherwise, treat as path that doesn't exist or is invalid
-    fprintf(stderr, "xcd-core: \"%s\" is not a directory and not a simple segment\n", arg);
-    return 1;
+    WORD_LIST *args = make_word_list(make_word(path), NULL);
+    int rc = cd(args);
+    dispose_words(args);
+    return rc;
 }
 
-/* ---------- main ---------- */
-
-int main(int argc, char **argv)
+int xcd_builtin(WORD_LIST *list)
 {
-    load_memory();
+    int argc;
+    // slot 0 is left free for argv[0], and argc already counts it
+    char **argv = strvec_from_word_list(list, 0, 1, &argc);
+    argv[0] = "xcd";
 
-    /* Management / info commands do NOT change dirs, and we won't
-       add the current dir for those (so 'xcd-core -c' really clears). */
+    trace_begin(&argc, argv);
 
-    if (argc >= 2)
+    // These read stdin or serve other processes; the shell is neither.
+    if (argc >= 2 && (strcmp(argv[1], "--batch") == 0 ||
+                      strcmp(argv[1], "--serve") == 0 ||
+                      strcmp(argv[1], "--client") == 0))
     {
-        const char *arg1 = argv[1];
+        builtin_error("%s: not available in the builtin; run xcd-core %s",
+                      argv[1], argv[1]);
+        free(argv);
+        return EX_USAGE;
+    }
 
-        if (strcmp(arg1, "-h") == 0 || strcmp(arg1, "--help") == 0)
-        {
-            cmd_help();
-            return 0;
-        }
+    // Out of memory or no HOME: give up on this call, not the shell.
+    jmp_buf abort_call;
+    if (setjmp(abort_call) != 0)
+    {
+        builtin_abort = NULL;
+        nav_target = NULL;
+        fflush(stdout);
+        fflush(stderr);
+        builtin_discard();
+        free(argv);
+        return EXECUTION_FAILURE;
+    }
+    builtin_abort = &abort_call;
+    builtin_thread = pthread_self();
 
-        if (strcmp(arg1, "-c") == 0)
-        {
-            cmd_clear();
-            return 0;
-        }
+    if (!builtin_loaded)
+    {
+        load_memory();
+        builtin_loaded = 1;
+    }
+    else
+    {
+        refresh_memory();
+    }
+    trace_phase(PHASE_COMMAND);
 
-        if (strcmp(arg1, "-l") == 0)
-        {
-            const char *segment = (argc >= 3) ? argv[2] : NULL;
-            cmd_list(segment);
-            return 0;
-        }
+    // Options print and return; only navigation changes directory.
+    int navigate = argc < 2 || argv[1][0] != '-' || argv[1][1] == '\0' ||
+                   strcmp(argv[1], "-w") == 0 || strcmp(argv[1], "-r") == 0 ||
+                   strcmp(argv[1], "-i") == 0;
+    char target[PATH_MAX];
+    target[0] = '\0';
+    if (navigate)
+        nav_target = target;
 
-        if (strcmp(arg1, "-p") == 0)
-        {
-            const char *segment = (argc >= 3) ? argv[2] : NULL;
-            cmd_preview(segment);
-            return 0;
-        }
+    int rc = run_command(argc, argv);
+
+    nav_target = NULL;
+    fflush(stdout);
+
+    trace_phase(PHASE_SAVE);
+    flush_memory();
+    trace_end(argc, argv);
+    fflush(stderr);
+
+    int status = (rc != 0) ? EXECUTION_FAILURE : EXECUTION_SUCCESS;
+    if (rc == 0 && navigate && target[0])
+        status = builtin_cd(target);
+    builtin_abort = NULL;
+    free(argv);
+    return status;
+}
+
+// Write anything still pending when the builtin is disabled.
+void xcd_builtin_unload(char *name)
+{
+    (void)name;
+    jmp_buf abort_call;
+    if (builtin_loaded && setjmp(abort_call) == 0)
+    {
+        builtin_abort = &abort_call;
+        builtin_thread = pthread_self();
+        flush_memory();
     }
+    builtin_abort = NULL;
+}
 
-    /* Navigation mode:
-       - First remember the directory we are currently in
-       - Then compute the target directory and remember that too
-    */
-    char cwd[PATH_MAX];
-    if (canonical_path(".", cwd, sizeof(cwd)))
-        remember_dir(cwd);
+static char *xcd_doc[] =
+{
+    "Jump to a remembered directory.",
+    "",
+    "With no argument, go to HOME.  With DIR, go there.  With SEGMENT,",
+    "go to the best remembered directory whose basename contains it;",
+    "repeat to cycle through the other matches.  -w SEGMENT looks only",
+    "inside the current project; -i picks a match interactively.  -l,",
+    "-p, -c, -x and -h work as for xcd-core (run xcd -h).",
+    NULL
+};
+
+struct builtin xcd_struct =
+{
+    "xcd",
+    xcd_builtin,
+    BUILTIN_ENABLED,
+    xcd_doc,
+    "xcd [-h | -c | -x | -l [SEGMENT] | -p SEGMENT | -w SEGMENT | -i [SEGMENT] | DIR | SEGMENT]",
+    0
+};
 
-    int rc;
+#endif /* XCD_BUILTIN */
 
-    if (argc == 1)
+/* ---------- main ---------- */
+
+// Define XCD_NO_MAIN to #include this file from another program
+// (see bench/xcd-bench.c); the bash builtin has no main() either.
+#if !defined(XCD_NO_MAIN) && !defined(XCD_BUILTIN)
+
+int main(int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "--serve") == 0)
     {
-        // No args: go to HOME
-        rc = cmd_navigate(0, NULL);
+        load_memory();
+        return cmd_serve();
     }
-    else
+
+    if (argc >= 2 && strcmp(argv[1], "--client") == 0)
     {
-        rc = cmd_navigate(argc - 1, &argv[1]);
+        // Drop the flag; with no server to ask, run as usual.
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+
+        int rc = serve_client(argc, argv);
+        if (rc >= 0)
+            return rc;
     }
 
+    trace_begin(&argc, argv);
+    load_memory();
+
+    trace_phase(PHASE_COMMAND);
+    int rc = (argc >= 2 && strcmp(argv[1], "--batch") == 0)
+                 ? cmd_batch(argc - 2, &argv[2])
+                 : run_command(argc, argv);
+
+    trace_phase(PHASE_SAVE);
     if (memory_dirty)
         save_memory();
+    if (index_dirty)
+        rebuild_index();
 
+    trace_end(argc, argv);
     return rc;
 }
 
+#endif /* !XCD_NO_MAIN && !XCD_BUILTIN */
@@ -2,13 +2,24 @@
 
 xcd()
 {
-    case "$1" in
-        -h|-c|-l|-p|--help)
-            xcd-core "$@"
+    # Hand requests to "xcd-core --serve" when it is running; --client
+    # falls back to doing the work itself if the socket is stale.
+    local sock="${XDG_RUNTIME_DIR:-/tmp}/xcd-core.sock"
+    [ -n "$XDG_RUNTIME_DIR" ] || sock="/tmp/xcd-core-$UID.sock"
+    local client=
+    [ -S "$sock" ] && client=--client
+
+    # --trace only adds a report on stderr: dispatch on what it runs.
+    local option="$1"
+    [ "$option" = "--trace" ] && option="$2"
+
+    case "$option" in
+        -h|-c|-g|-l|-p|-s|-x|--stats|--help)
+            xcd-core $client "$@"
             ;;
         *)
             local target
-            target=$(xcd-core "$@")
+            target=$(xcd-core $client "$@")
             local status=$?
             if [ $status -ne 0 ]
             then